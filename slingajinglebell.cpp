@@ -22,12 +22,39 @@
 
 //---------------------------------------------------------------------------
 #include <assert.h>
+#include <errno.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <string>
+#include <vector>
 #include <iostream>
 #include <sstream>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <deque>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if defined(_LINUX)
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(_ALSA)
+#include <alsa/asoundlib.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 //---------------------------------------------------------------------------
 #include "chai3d.h"
 
@@ -89,13 +116,23 @@ string resourceRoot;
 // has exited haptics simulation thread
 bool simulationFinished = false;
 
+// run without window and device, driven by a scripted device
+bool headless = false;
+
+// largest force the device can render
+double deviceMaxForce;
+
+// was the force sent last tick clipped by the device
+bool forceSaturated = false;
+
 // Limit movement in x-axis
 bool limitX = false;
 
-// show homerun
+// show homerun (graphics thread)
 bool homerun = false;
 string homerunTexts[] = { "Great!", "wow!", "HOMERUN", "You da best!!!",
 		"BULL'S EYE", "KA-CHING", "*splat*" };
+const int HOMERUN_TEXTS = sizeof(homerunTexts) / sizeof(homerunTexts[0]);
 cLabel* titleLabel;
 
 const double CAMERA_X = 3.8;
@@ -109,7 +146,8 @@ const double CAMERA_X = 3.8;
 //---------------------------------------------------------------------------
 // World constants
 //---------------------------------------------------------------------------
-cVector3d const GRAVITY = cVector3d(0, 0, -0.00982);
+// positions are in world units, velocities in units per second
+cVector3d const GRAVITY = cVector3d(0, 0, -9.82);
 cVector3d const center = cVector3d(0, 0, 0);
 
 //---------------------------------------------------------------------------
@@ -120,56 +158,73 @@ cVector3d const center = cVector3d(0, 0, 0);
 cShapeSphere* device;
 double deviceRadius;
 
-// Projectile
-cVector3d projectileVel;
-cShapeSphere* projectile;
+// Projectiles (simulated in projectilePool by the haptics thread, the
+// spheres are only moved by the graphics thread)
 double projectileRadius = 0.1;
 double projectileMass = 10;
-bool collided = false; // Has the projectile collided with a target???
+
+// how many projectiles can be in play, older ones are taken back first
+const int MAX_PROJECTILES = 16;
+
+// points of the aim preview arc
+const int MAX_PREVIEW_POINTS = 256;
+
+// points of the two sling bands, drawn by the graphics thread
+const int MAX_BAND_POINTS = 129;
 
 // Slingshot
-cShapeLine* slingSpringLine;
 cVector3d poleTopPos(0, -0.25, 0);
-cShapeLine* slingSpringLine2;
 cVector3d poleTopPos2(0, 0.25, 0);
 cShapeSphere* slingCenter;
+cVector3d slingCenterPos(0, 0, 0);
 cVector3d slingCenterVel(0, 0, 0);
-bool springFired = false;
-double prevStretch = 0;
 double slingSpringConst = 30;
+// stiffness of the sling bands pulling on the projectile when fired
+double slingLaunchStiffness = 1000;
+// spring and drag bringing the sling back to rest after a throw
+double slingReturnStiffness = 1000;
+double slingReturnDrag = 0.8;
 double slingVibrationConst = 8;
-double vibrationStep = 0.001;
+// the vibration fades in between these hand speeds (per second), so that
+// holding the sling still does not buzz
+double vibrationMinSpeed = 0.2;
+double vibrationMaxSpeed = 1.0;
+// how much of the error the hand velocity filter corrects each tick
+double handFilterAlpha = 0.1;
 bool sendForce = true;
 
 // Floor grid
 const int gridLineNumber = 80;
 float gridLineSpacing = 0.6;
+cGenericObject* floorGrid;
 
 float groundZ = -1.0;
 
 bool keyDown = false;
 
-double springFiredStep;
-
 bool vibrate = true;
 
 double deviceCenterForce = 10;
 cVector3d deviceCenter;
 
-// Target data
-const int TARGETS = 3;
-
+// The physics run in fixed steps of PHYSICS_TICK / physicsSubSteps, however
+// fast the haptics loop happens to run. Time left over from a tick is
+// carried to the next one, at most MAX_PHYSICS_LAG of it.
+const double PHYSICS_TICK = 0.001;
+const double MAX_PHYSICS_LAG = 0.05;
+int physicsSubSteps = 1;
+double physicsTimeStep = PHYSICS_TICK;
+double physicsAccumulator = 0;
+
+// Target data (the levels are read from a level pack)
+const int MAX_TARGETS = 512;
 const double TARGET_RADIUS = 0.2;
-double targetPositions[][9] = { { 10, 0, 0, 10, 0, 0, 10, 0, 0 }, // 0
-		{ -3, 1, 0, -3, -1, 0, -3, 0, 0 }, // 1
-		{ -3, 0.8, -0.5, -3, -0.8, 0.4, -3, 0, -0.2 }, // 2
-		{ -1, 1, 0, -8, -1, 0, -4.5, 0, 0 }, // 3
-		{ -7, 1, groundZ, -8, -1, groundZ, -6, 0.4, 0 }, // 4
-		{ -7, 1, -0.6, -15, -2, 0.5, -10, 0.2, groundZ } // 5
-};
-int levels = 6;
 int level = 0;
 
+// bumped every time the targets are set up, the graphics thread rebuilds
+// the target meshes when it changes
+int levelSerial = 0;
+
 // Delay
 bool delay = false;
 double timer;
@@ -201,12 +256,344 @@ void updateGraphics(void);
 // main haptics loop
 void updateHaptics(void);
 
+// one iteration of the haptics loop
+void hapticTick(double timeInterval);
+
+// advance the projectile, sling and targets by one fixed time step
+void stepPhysics(double dt);
+
+// run the haptics loop as fast as possible on the scripted device
+void runHeadless(void);
+
+// read the next headless tick from the script or the replayed trace
+bool nextHeadlessTick(double& timeInterval);
+
+// print the result of recording or replaying a trace
+void reportTrace(void);
+
 // compute forces between tool and environment
 cVector3d computeForce(const cVector3d& a_cursor, double a_cursorRadius,
 		const cVector3d& a_spherePos, double a_radius, double a_stiffness);
 
 cVector3d getVibrationForceVector(double intensity);
 
+// create the floor grid as one line batch
+cGenericObject* createFloorGrid(void);
+
+
+// run one of the --bench benchmarks
+int runBenchmark(const char* name);
+
+// time the vibration generator against the random() based one
+void benchmarkVibration(void);
+
+// time the grid broad-phase against testing every target
+void benchmarkCollision(void);
+
+// time the trajectory kernel against the cVector3d code
+void benchmarkTrajectory(void);
+
+// time the sling band solver for different numbers of segments
+void benchmarkBands(void);
+
+// measure how far the drawn device lags the hand, with and without prediction
+void benchmarkLatency(void);
+
+// time drawing the batched floor grid against one scene graph node per line
+void benchmarkGrid(void);
+
+// resize a shadow millions of times and check that memory stays flat
+void benchmarkShadow(void);
+
+// print the haptics loop timing statistics
+void printTimingReport(void);
+
+// start the thread that writes the telemetry events
+void startTelemetry(const char* fileName);
+
+// body of the telemetry writer thread
+void writeTelemetry(void);
+
+// write the remaining telemetry events and stop the writer
+void stopTelemetry(void);
+
+// start playing sounds, or writing them to a file when headless
+void startSound(const char* fileName);
+
+// body of the audio thread
+void runSound(void);
+
+// stop the sound and report its latency
+void stopSound(void);
+
+// reload the level pack when its file changes
+void watchLevelPack(void);
+
+// find out which pull-backs clear the levels of the level pack
+int solveLevels(int threads, const char* tableFile);
+
+// keep a generated level pack ready for endless play
+void generateEndless(void);
+
+//////////////////////////////////////////
+// Random numbers
+//////////////////////////////////////////
+/**
+ * xorshift64* generator. Every thread has its own (threadRandom), so unlike
+ * random() it takes no lock and never waits for another thread.
+ */
+class FastRandom {
+private:
+	unsigned long long state;
+public:
+	FastRandom(unsigned long long);
+	unsigned long long next();
+	double uniform();
+};
+
+FastRandom::FastRandom(unsigned long long seed) {
+	// the state must never be zero
+	state = seed * 0x9E3779B97F4A7C15ULL + 1;
+}
+
+unsigned long long FastRandom::next() {
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 2685821657736338717ULL;
+}
+
+/**
+ * Returns a number in [0, 1).
+ */
+double FastRandom::uniform() {
+	return (next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// gives every thread a different seed
+std::atomic<unsigned long long> randomSeed(1);
+
+thread_local FastRandom threadRandom(randomSeed.fetch_add(1));
+
+//////////////////////////////////////////
+// Haptic loop timing
+//////////////////////////////////////////
+/**
+ * Histogram of durations in bins growing with the duration: 1 ns wide up to
+ * 16 ns, then 16 bins to every doubling (so within 7%), up to about 1 s,
+ * plus one bin for anything longer. Written by one thread only and read by
+ * any thread, all counters are atomics so neither side takes a lock.
+ */
+class TimingHistogram {
+private:
+	// bins to every doubling of the duration
+	static const int SUB_BINS = 16;
+	static const int BINS = 27 * SUB_BINS;
+	std::atomic<unsigned int> bins[BINS + 1];
+	std::atomic<unsigned long long> count;
+	std::atomic<unsigned long long> total;
+	std::atomic<long long> longest;
+
+	static int binOf(long long);
+	static long long binStart(int);
+public:
+	TimingHistogram();
+	void add(long long);
+	unsigned long long getCount();
+	double getMean();
+	double getPercentile(double);
+	double getMax();
+	void print(const char*);
+	void printBars(void);
+};
+
+TimingHistogram::TimingHistogram() {
+	for (int i = 0; i <= BINS; i++) {
+		bins[i] = 0;
+	}
+	count = 0;
+	total = 0;
+	longest = 0;
+}
+
+/**
+ * Bin of a duration in nanoseconds, BINS if it is too long for the others.
+ */
+int TimingHistogram::binOf(long long ns) {
+	if (ns < SUB_BINS) {
+		return ns < 0 ? BINS : (int) ns;
+	}
+	// shift the duration down to [SUB_BINS, 2 * SUB_BINS)
+	int shift = 0;
+	while (ns >= 2 * SUB_BINS) {
+		ns >>= 1;
+		shift++;
+	}
+	int bin = (shift + 1) * SUB_BINS + (int) ns - SUB_BINS;
+	return bin < BINS ? bin : BINS;
+}
+
+/**
+ * Shortest duration in nanoseconds that falls in the bin.
+ */
+long long TimingHistogram::binStart(int bin) {
+	if (bin < SUB_BINS) {
+		return bin;
+	}
+	int shift = bin / SUB_BINS - 1;
+	return (long long) (SUB_BINS + bin % SUB_BINS) << shift;
+}
+
+/**
+ * Adds a duration in nanoseconds. There is only one writer, so plain
+ * loads and stores are enough and no locked instruction is needed.
+ */
+void TimingHistogram::add(long long ns) {
+	int bin = binOf(ns);
+	bins[bin].store(bins[bin].load(std::memory_order_relaxed) + 1,
+			std::memory_order_relaxed);
+	total.store(total.load(std::memory_order_relaxed) + ns,
+			std::memory_order_relaxed);
+	if (ns > longest.load(std::memory_order_relaxed)) {
+		longest.store(ns, std::memory_order_relaxed);
+	}
+	count.store(count.load(std::memory_order_relaxed) + 1,
+			std::memory_order_release);
+}
+
+unsigned long long TimingHistogram::getCount() {
+	return count.load(std::memory_order_acquire);
+}
+
+/**
+ * Mean duration in microseconds.
+ */
+double TimingHistogram::getMean() {
+	unsigned long long n = getCount();
+	return n > 0 ? total.load(std::memory_order_relaxed) / 1000.0 / n : 0;
+}
+
+/**
+ * Duration in microseconds that the given fraction of samples stay under,
+ * to the resolution of a bin and never more than the longest.
+ */
+double TimingHistogram::getPercentile(double fraction) {
+	unsigned long long n = getCount();
+	unsigned long long seen = 0;
+	for (int i = 0; i < BINS; i++) {
+		seen += bins[i].load(std::memory_order_relaxed);
+		if (seen >= fraction * n) {
+			return cMin(binStart(i + 1) / 1000.0, getMax());
+		}
+	}
+	return getMax();
+}
+
+/**
+ * Longest duration in microseconds.
+ */
+double TimingHistogram::getMax() {
+	return longest.load(std::memory_order_relaxed) / 1000.0;
+}
+
+void TimingHistogram::print(const char* label) {
+	printf("%-12s %10llu  mean %8.1f  p50 %7.1f  p99 %7.1f  p99.9 %7.1f"
+		"  max %9.1f us\n", label, getCount(), getMean(), getPercentile(0.5),
+			getPercentile(0.99), getPercentile(0.999), getMax());
+}
+
+/**
+ * Prints the histogram as bars of 100 us up to 5 ms, and one bar for
+ * anything longer. A bin goes to the bar its shortest duration is in.
+ */
+void TimingHistogram::printBars(void) {
+	unsigned long long n = getCount();
+	if (n == 0) {
+		return;
+	}
+	const int BARS = 50;
+	const long long BAR_WIDTH = 100000; // ns
+	unsigned long long bars[BARS + 1] = { 0 };
+	for (int i = 0; i <= BINS; i++) {
+		long long bar = i < BINS ? binStart(i) / BAR_WIDTH : BARS;
+		bars[cMin(bar, (long long) BARS)] += bins[i].load(
+				std::memory_order_relaxed);
+	}
+	for (int i = 0; i <= BARS; i++) {
+		if (bars[i] == 0) {
+			continue;
+		}
+		int width = (int) (60.0 * bars[i] / n + 0.5);
+		if (i < BARS) {
+			printf("  %5.1f ms %10llu %s\n", i * BAR_WIDTH / 1e6, bars[i],
+					string(width, '#').c_str());
+		} else {
+			printf("  longer   %10llu %s\n", bars[i],
+					string(width, '#').c_str());
+		}
+	}
+}
+
+// phases of a haptic tick that are timed separately
+enum HapticPhase {
+	PHASE_DEVICE_READ,
+	PHASE_SLING,
+	PHASE_PROJECTILE,
+	PHASE_COLLISION,
+	PHASE_SET_FORCE,
+	PHASE_COUNT
+};
+
+const char* HAPTIC_PHASE_NAMES[PHASE_COUNT] = { "device read", "sling",
+		"projectile", "collision", "setForce" };
+
+// a tick period longer than this is counted as an overrun of the 1 kHz loop
+const long long OVERRUN_PERIOD = 1500000; // ns
+
+TimingHistogram tickPeriods;
+TimingHistogram phaseTimes[PHASE_COUNT];
+std::atomic<unsigned long long> tickOverruns(0);
+
+// time spent in each phase during the current tick, and when it started
+long long phaseTime[PHASE_COUNT];
+long long lastTickStart = 0;
+
+long long nowNs(void) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//////////////////////////////////////////
+// Scaled mesh class
+//////////////////////////////////////////
+/**
+ * A mesh that is drawn with a uniform scale applied to it, so that resizing
+ * it does not touch its vertices.
+ */
+class ScaledMesh: public cMesh {
+public:
+	ScaledMesh(cWorld*);
+	double scale;
+	virtual void render(const int a_renderMode = 0);
+};
+
+ScaledMesh::ScaledMesh(cWorld *world) :
+	cMesh(world) {
+	scale = 1;
+}
+
+void ScaledMesh::render(const int a_renderMode) {
+	glPushMatrix();
+	glScaled(scale, scale, scale);
+
+	// the normals get scaled too, keep them unit length for the lighting
+	glEnable(GL_NORMALIZE);
+	cMesh::render(a_renderMode);
+	glDisable(GL_NORMALIZE);
+
+	glPopMatrix();
+}
+
 //////////////////////////////////////////
 // Circle class
 //////////////////////////////////////////
@@ -215,27 +602,25 @@ private:
 	cWorld* world;
 	cVector3d pos;
 	double radius;
-	cMesh* circle;
-	void resetGeometry();
-	double rotationAngle;
-	cVector3d rotationAxis;
-	cMaterial mat;
+	ScaledMesh* circle;
+	void createGeometry();
 public:
 	CircleMesh(cWorld*, cVector3d, double);
 	void setColor(double, double, double);
 	void setPos(cVector3d);
 	void rotate(cVector3d, double);
+	void setRot(cMatrix3d);
 	void setRadius(double);
-	void remove();
+	void setShowEnabled(bool);
 	virtual ~CircleMesh();
 };
 
 CircleMesh::CircleMesh(cWorld *world, cVector3d pos, double radius) {
 	this->world = world;
 	this->pos = pos;
-	this->radius = radius;
 
-	resetGeometry();
+	createGeometry();
+	setRadius(radius);
 }
 
 void CircleMesh::setColor(double r, double g, double b) {
@@ -245,7 +630,6 @@ void CircleMesh::setColor(double r, double g, double b) {
 	mat.m_diffuse.set(r, g, b);
 	mat.m_specular.set(r, g, b);
 	circle->setMaterial(mat);
-	this->mat = mat;
 }
 
 void CircleMesh::setPos(cVector3d pos) {
@@ -254,30 +638,31 @@ void CircleMesh::setPos(cVector3d pos) {
 }
 
 void CircleMesh::rotate(cVector3d axis, double angle) {
-	this->rotationAxis = axis;
-	this->rotationAngle = angle;
 	circle->rotate(axis, angle);
 }
 
+void CircleMesh::setRot(cMatrix3d rot) {
+	circle->setRot(rot);
+}
+
 void CircleMesh::setRadius(double radius) {
+	// the geometry is a unit circle, the radius is just a scale
 	this->radius = radius;
-	resetGeometry();
+	circle->scale = radius;
 }
 
 /**
- * Removes all triangles and creates them anew
- * (great when the radius has been changed for example!)
+ * Creates the triangles of a unit circle, once. The radius is applied when
+ * rendering, so it can change every frame for free.
  */
-void CircleMesh::resetGeometry() {
-	world->removeChild(circle);
-	circle = new cMesh(world);
+void CircleMesh::createGeometry() {
+	circle = new ScaledMesh(world);
 
 	int res = 40;
 	double step = 2 * M_PI / res;
 	int v0, v1, v2;
 	for (int i = 0; i < res; i++) {
-		v2 = circle->newVertex(0, radius * sin(i * step), radius
-				* cos(i * step));
+		v2 = circle->newVertex(0, sin(i * step), cos(i * step));
 		if (i == 0) {
 			v0 = v2;
 		} else if (i == 1) {
@@ -289,15 +674,13 @@ void CircleMesh::resetGeometry() {
 	}
 
 	circle->setPos(this->pos);
-	circle->rotate(this->rotationAxis, this->rotationAngle);
-	circle->setMaterial(this->mat);
 	circle->computeAllNormals();
 
 	world->addChild(circle);
 }
 
-void CircleMesh::remove() {
-	world->removeChild(circle);
+void CircleMesh::setShowEnabled(bool show) {
+	circle->setShowEnabled(show);
 }
 
 CircleMesh::~CircleMesh() {
@@ -305,162 +688,4487 @@ CircleMesh::~CircleMesh() {
 }
 
 //////////////////////////////////////////
-// Target class
+// Line batch class
 //////////////////////////////////////////
-class Target {
+/**
+ * A set of colored line segments kept in one vertex array and drawn with a
+ * single glDrawArrays call, instead of one scene graph node per line.
+ */
+class LineBatch: public cGenericObject {
 private:
-	bool collided;
-	cVector3d pos;
-	double radius;
-	CircleMesh* target;
-	cShapeLine* line;
-	cWorld* world;
-
+	vector<float> vertices;
+	vector<float> colors;
 public:
-	Target(cWorld*, cVector3d, double);
-	bool sphereCollide(cShapeSphere*);
-	void setColor(double, double, double);
-	void remove();
-	bool hasCollided();
-	void rotate();
-    void updatePos();
-    cVector3d vel;
-    void setVel(cVector3d);
-	virtual ~Target();
+	LineBatch();
+	void addLine(cVector3d, cVector3d, cColorf, cColorf);
+	void clear();
+	int getLineCount();
+	virtual void render(const int a_renderMode = 0);
+	virtual ~LineBatch();
 };
 
-Target::Target(cWorld *world, cVector3d pos, double radius) {
-	collided = false;
-	this->world = world;
-	this->pos = pos;
-	this->radius = radius;
-	target = new CircleMesh(world, pos, radius);
-	target->setColor(0, 1, 0);
-	// create a line that runs to the floor
-	cVector3d floor;
-	floor.copyfrom(pos);
-	floor.z = groundZ;
-	line = new cShapeLine(floor, pos);
-	world->addChild(line);
-    vel = cVector3d(0,0,0);
+LineBatch::LineBatch() {
 }
 
-bool Target::sphereCollide(cShapeSphere *sphere) {
-	double distance = (cSub(sphere->getPos(), pos)).length();
-	bool col = distance < radius + sphere->getRadius();
-	if (col) {
-		collided = true;
-		target->setColor(1, 0, 0);
-	}
-	return col;
+void LineBatch::addLine(cVector3d a, cVector3d b, cColorf colorA,
+		cColorf colorB) {
+	vertices.push_back(a.x);
+	vertices.push_back(a.y);
+	vertices.push_back(a.z);
+	vertices.push_back(b.x);
+	vertices.push_back(b.y);
+	vertices.push_back(b.z);
+
+	colors.push_back(colorA.getR());
+	colors.push_back(colorA.getG());
+	colors.push_back(colorA.getB());
+	colors.push_back(colorA.getA());
+	colors.push_back(colorB.getR());
+	colors.push_back(colorB.getG());
+	colors.push_back(colorB.getB());
+	colors.push_back(colorB.getA());
 }
 
-void Target::setColor(double r, double g, double b) {
-	target->setColor(r, g, b);
+void LineBatch::clear() {
+	vertices.clear();
+	colors.clear();
 }
 
-void Target::remove() {
-	target->remove();
-	world->removeChild(line);
+int LineBatch::getLineCount() {
+	return vertices.size() / 6;
 }
 
-bool Target::hasCollided() {
-	return collided;
-}
+void LineBatch::render(const int a_renderMode) {
+	// like cShapeLine, the lines are opaque and skip the transparent passes
+	if (a_renderMode == CHAI_RENDER_MODE_TRANSPARENT_FRONT_ONLY
+			|| a_renderMode == CHAI_RENDER_MODE_TRANSPARENT_BACK_ONLY
+			|| vertices.empty()) {
+		return;
+	}
 
-void Target::rotate() {
-	target->rotate(cVector3d(0, 1, 0), -M_PI / 2);
-}
+	// same state as cShapeLine, but all lines go out in one call
+	glDisable(GL_LIGHTING);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 0, &vertices[0]);
+	glColorPointer(4, GL_FLOAT, 0, &colors[0]);
 
-void Target::updatePos(){
-if(vel.x!=0||vel.y!=0||vel.z!=0){
-    vel.add(cMul(0.001,GRAVITY));
-    pos.add(vel);
-    target->setPos(pos);
-    target->rotate(cVector3d((double) random() / RAND_MAX,(double) random() / RAND_MAX,(double) random() / RAND_MAX),((double) random() / RAND_MAX)/50);
-}
-}
+	glDrawArrays(GL_LINES, 0, vertices.size() / 3);
 
-void Target::setVel(cVector3d nVel){
-    vel = cVector3d(nVel.x, nVel.y, nVel.z);
+	glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glEnable(GL_LIGHTING);
 }
 
-Target::~Target() {
+LineBatch::~LineBatch() {
 
 }
 
-// Targets
-Target* currentTargets[3];
+//////////////////////////////////////////
+// Level pack
+//////////////////////////////////////////
+/**
+ * One target of a level as written in the level pack. The angle is in
+ * radians.
+ */
+struct TargetDef {
+	cVector3d pos;
+	double radius;
+	cVector3d axis;
+	double angle;
+	cVector3d vel;
+};
 
-// projectile shadow
-CircleMesh* projectileShadowCircle;
+/**
+ * A level is a run of targets in the pack and the box its moving targets
+ * stay in.
+ */
+struct LevelDef {
+	int firstTarget;
+	int targetCount;
+	cVector3d boundsMin;
+	cVector3d boundsMax;
+};
 
-void setLevel(int);
-void setHomerun(bool);
+/**
+ * The levels of the game, read from a text file (see levels.txt for the
+ * format). A pack is never changed after it has been loaded; a reload
+ * builds a new one.
+ */
+class LevelPack {
+private:
+	vector<LevelDef> levels;
+	vector<TargetDef> targets;
+	// FNV-1a hash of the text the levels were read from
+	unsigned long long hash;
+	const char* parseLine(const char*, const char*);
+public:
+	bool load(const char*);
+	bool parse(const char*, size_t, const char*);
+	unsigned long long getHash();
+	int getLevelCount();
+	const LevelDef& getLevel(int);
+	const TargetDef& getTarget(int);
+};
 
-//===========================================================================
-/*
- DEMO:    GEM_membrane.cpp
+// the levels used when there is no level pack file
+const char* DEFAULT_LEVEL_PACK = "level\n"
+	"target 10 0 0\ntarget 10 0 0\ntarget 10 0 0\n"
+	"level\n"
+	"target -3 1 0\ntarget -3 -1 0\ntarget -3 0 0\n"
+	"level\n"
+	"target -3 0.8 -0.5\ntarget -3 -0.8 0.4\ntarget -3 0 -0.2\n"
+	"level\n"
+	"target -1 1 0\ntarget -8 -1 0\ntarget -4.5 0 0\n"
+	"level\n"
+	"target -7 1 -1 rot 0 1 0 -90\ntarget -8 -1 -1 rot 0 1 0 -90\n"
+	"target -6 0.4 0\n"
+	"level\n"
+	"target -7 1 -0.6\ntarget -15 -2 0.5\ntarget -10 0.2 -1 rot 0 1 0 -90\n";
+
+bool isBlank(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
 
- This application illustrates the use of the GEM libraries to simulate
- deformable object. In this example we load a simple mesh object and
- build a dynamic skeleton composed of volumetric spheres and 3 dimensional
- springs which model torsion, flexion and elongation properties.
+/**
+ * Reads the next word between p and end and moves p past it. The word is
+ * not copied, it points into the text.
  */
-//===========================================================================
+bool readWord(const char*& p, const char* end, const char*& word,
+		size_t& length) {
+	while (p < end && isBlank(*p)) {
+		p++;
+	}
+	word = p;
+	while (p < end && !isBlank(*p)) {
+		p++;
+	}
+	length = p - word;
+	return length > 0;
+}
 
-int main(int argc, char* argv[]) {
-	//-----------------------------------------------------------------------
-	// INITIALIZATION
-	//-----------------------------------------------------------------------
+bool isWord(const char* word, size_t length, const char* expected) {
+	return strlen(expected) == length && strncmp(word, expected, length) == 0;
+}
 
-	// parse first arg to try and locate resources
-	resourceRoot = string(argv[0]).substr(0,
-			string(argv[0]).find_last_of("/\\") + 1);
+/**
+ * Reads a decimal number such as -12, 0.25 or 1e-3 and moves p past it.
+ * The text does not need to be null terminated, unlike for strtod.
+ */
+bool readNumber(const char*& p, const char* end, double& value) {
+	const char* q = p;
+	while (q < end && isBlank(*q)) {
+		q++;
+	}
+	bool negative = false;
+	if (q < end && (*q == '-' || *q == '+')) {
+		negative = *q == '-';
+		q++;
+	}
 
-	//-----------------------------------------------------------------------
-	// 3D - SCENEGRAPH
-	//-----------------------------------------------------------------------
+	// all digits as one integer, divided by a power of ten at the end so
+	// that the result is rounded the same way as a literal
+	double mantissa = 0;
+	int digits = 0;
+	int decimals = 0;
+	while (q < end && *q >= '0' && *q <= '9') {
+		mantissa = mantissa * 10 + (*q++ - '0');
+		digits++;
+	}
+	if (q < end && *q == '.') {
+		q++;
+		while (q < end && *q >= '0' && *q <= '9') {
+			mantissa = mantissa * 10 + (*q++ - '0');
+			digits++;
+			decimals++;
+		}
+	}
+	if (digits == 0) {
+		return false;
+	}
+	int exponent = 0;
+	if (q < end && (*q == 'e' || *q == 'E')) {
+		q++;
+		int sign = 1;
+		if (q < end && (*q == '-' || *q == '+')) {
+			sign = *q == '-' ? -1 : 1;
+			q++;
+		}
+		if (q == end || *q < '0' || *q > '9') {
+			return false;
+		}
+		while (q < end && *q >= '0' && *q <= '9') {
+			exponent = exponent * 10 + (*q++ - '0');
+		}
+		exponent *= sign;
+	}
+	if (q < end && !isBlank(*q)) {
+		return false;
+	}
 
-	// create a new world.
-	world = new cWorld();
+	exponent -= decimals;
+	value = exponent < 0 ? mantissa / pow(10.0, -exponent) : mantissa * pow(
+			10.0, exponent);
+	if (negative) {
+		value = -value;
+	}
+	p = q;
+	return true;
+}
 
-	// set the background color of the environment
-	// the color is defined by its (R,G,B) components.
-	world->setBackgroundColor(0.0, 0.0, 0.0);
+bool readVector(const char*& p, const char* end, cVector3d& v) {
+	return readNumber(p, end, v.x) && readNumber(p, end, v.y) && readNumber(
+			p, end, v.z);
+}
 
-	// create a camera and insert it into the virtual world
-	camera = new cCamera(world);
-	world->addChild(camera);
+/**
+ * Reads a level pack file. The file is mapped into memory where the
+ * platform allows it and parsed where it lies. Returns false and prints
+ * the reason if the file cannot be read or has errors.
+ */
+bool LevelPack::load(const char* fileName) {
+#if defined(_LINUX)
+	int file = open(fileName, O_RDONLY);
+	if (file < 0) {
+		printf("%s: %s\n", fileName, strerror(errno));
+		return false;
+	}
+	struct stat info;
+	if (fstat(file, &info) != 0) {
+		printf("%s: %s\n", fileName, strerror(errno));
+		::close(file);
+		return false;
+	}
+	if (info.st_size == 0) {
+		::close(file);
+		return parse("", 0, fileName);
+	}
+	void* text = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	int error = errno;
+	::close(file);
+	if (text == MAP_FAILED) {
+		printf("%s: %s\n", fileName, strerror(error));
+		return false;
+	}
+	bool ok = parse((const char*) text, info.st_size, fileName);
+	munmap(text, info.st_size);
+	return ok;
+#else
+	FILE* file = fopen(fileName, "rb");
+	if (file == NULL) {
+		printf("%s: %s\n", fileName, strerror(errno));
+		return false;
+	}
+	string text;
+	char buffer[4096];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+		text.append(buffer, n);
+	}
+	fclose(file);
+	return parse(text.data(), text.size(), fileName);
+#endif
+}
 
-	// position and orient the camera
-	camera->set(cVector3d(CAMERA_X, 0.0, 0.0), // camera position (eye)
-			cVector3d(0.0, 0.0, 0.0), // look-at position (target)
-			cVector3d(0.0, 0.0, 1.0)); // direction of the "up" vector
+/**
+ * Parses length bytes of level pack text. The name is only used in error
+ * messages.
+ */
+bool LevelPack::parse(const char* text, size_t length, const char* name) {
+	levels.clear();
+	targets.clear();
+	hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ (unsigned char) text[i]) * 1099511628211ULL;
+	}
 
-	// set the near and far clipping planes of the camera
-	// anything in front/behind these clipping planes will not be rendered
-	camera->setClippingPlanes(0.01, 100.0);
+	const char* p = text;
+	const char* end = text + length;
+	int lineNumber = 0;
+	while (p < end) {
+		const char* lineEnd = (const char*) memchr(p, '\n', end - p);
+		if (lineEnd == NULL) {
+			lineEnd = end;
+		}
+		lineNumber++;
+
+		// the rest of the line after # is a comment
+		const char* comment = (const char*) memchr(p, '#', lineEnd - p);
+		const char* error = parseLine(p, comment != NULL ? comment : lineEnd);
+		if (error != NULL) {
+			printf("%s:%i: %s\n", name, lineNumber, error);
+			return false;
+		}
+		p = lineEnd + 1;
+	}
 
-	// enable higher rendering quality because we are displaying transparent objects
-	camera->enableMultipassTransparency(true);
+	if (levels.empty()) {
+		printf("%s: no levels\n", name);
+		return false;
+	}
+	for (unsigned int i = 0; i < levels.size(); i++) {
+		if (levels[i].targetCount == 0) {
+			printf("%s: level %u has no targets\n", name, i);
+			return false;
+		}
+	}
+	return true;
+}
 
-	// create a light source and attach it to the camera
-	light = new cLight(world);
-	camera->addChild(light); // attach light to camera
-	light->setEnabled(true); // enable light source
-	light->setPos(cVector3d(2.0, 0.5, 1.0)); // position the light source
-	light->setDir(cVector3d(-2.0, 0.5, 1.0)); // define the direction of the light beam
+unsigned long long LevelPack::getHash() {
+	return hash;
+}
+
+/**
+ * Parses one line without its comment, returns an error message or NULL.
+ */
+const char* LevelPack::parseLine(const char* p, const char* end) {
+	const char* word;
+	size_t length;
+	if (!readWord(p, end, word, length)) {
+		return NULL;
+	}
+
+	if (isWord(word, length, "level")) {
+		LevelDef def;
+		def.firstTarget = targets.size();
+		def.targetCount = 0;
+		def.boundsMin = cVector3d(-20, -3, groundZ);
+		def.boundsMax = cVector3d(0, 3, 2);
+		while (readWord(p, end, word, length)) {
+			if (!isWord(word, length, "bounds")) {
+				return "unknown level option";
+			}
+			if (!readVector(p, end, def.boundsMin) || !readVector(p, end,
+					def.boundsMax)) {
+				return "bounds needs two corners";
+			}
+		}
+		levels.push_back(def);
+	} else if (isWord(word, length, "target")) {
+		if (levels.empty()) {
+			return "target before the first level";
+		}
+		if (levels.back().targetCount == MAX_TARGETS) {
+			return "too many targets in the level";
+		}
+		TargetDef def;
+		if (!readVector(p, end, def.pos)) {
+			return "target needs a position";
+		}
+		def.radius = TARGET_RADIUS;
+		def.axis = cVector3d(0, 0, 1);
+		def.angle = 0;
+		def.vel = cVector3d(0, 0, 0);
+		while (readWord(p, end, word, length)) {
+			if (isWord(word, length, "radius")) {
+				if (!readNumber(p, end, def.radius) || def.radius <= 0) {
+					return "radius needs a positive number";
+				}
+			} else if (isWord(word, length, "rot")) {
+				if (!readVector(p, end, def.axis) || !readNumber(p, end,
+						def.angle) || def.axis.length() == 0) {
+					return "rot needs an axis and an angle in degrees";
+				}
+				def.axis.normalize();
+				def.angle *= M_PI / 180;
+			} else if (isWord(word, length, "vel")) {
+				if (!readVector(p, end, def.vel)) {
+					return "vel needs a velocity";
+				}
+			} else {
+				return "unknown target option";
+			}
+		}
+		targets.push_back(def);
+		levels.back().targetCount++;
+	} else {
+		return "expected level or target";
+	}
+	return NULL;
+}
+
+int LevelPack::getLevelCount() {
+	return levels.size();
+}
+
+const LevelDef& LevelPack::getLevel(int i) {
+	return levels[i];
+}
+
+const TargetDef& LevelPack::getTarget(int i) {
+	return targets[i];
+}
+
+// the level pack being played (haptics thread) and the file it came from
+LevelPack* levelPack;
+string levelPackFile;
+
+// a reloaded pack waiting to be taken by the haptics thread
+std::atomic<LevelPack*> pendingPack(NULL);
+
+// the pack the haptics thread stopped using, freed by the file watcher
+// or the endless level generator
+std::atomic<LevelPack*> retiredPack(NULL);
+
+// endless play: a freshly generated pack, taken by the haptics thread when
+// the last level of the current one is cleared
+bool endless = false;
+std::atomic<LevelPack*> generatedPack(NULL);
+
+//////////////////////////////////////////
+// Trajectory kernel
+//////////////////////////////////////////
+// The bodies of the batched physics (projectiles, simulated throws) are
+// kept as one array per coordinate, so that the kernels below can advance
+// several of them per instruction. AVX does 4 bodies at a time when the
+// compiler targets it (-mavx), SSE2 does 2 and is always there on x86-64;
+// anything else, and the bodies left over, take the scalar path.
+#if defined(__AVX__)
+#define SIMD_WIDTH 4
+typedef __m256d SimdDouble;
+inline SimdDouble simdLoad(const double* p) { return _mm256_loadu_pd(p); }
+inline void simdStore(double* p, SimdDouble a) { _mm256_storeu_pd(p, a); }
+inline SimdDouble simdSet(double a) { return _mm256_set1_pd(a); }
+inline SimdDouble simdAdd(SimdDouble a, SimdDouble b) { return _mm256_add_pd(a, b); }
+inline SimdDouble simdSub(SimdDouble a, SimdDouble b) { return _mm256_sub_pd(a, b); }
+inline SimdDouble simdMul(SimdDouble a, SimdDouble b) { return _mm256_mul_pd(a, b); }
+inline SimdDouble simdDiv(SimdDouble a, SimdDouble b) { return _mm256_div_pd(a, b); }
+inline SimdDouble simdSqrt(SimdDouble a) { return _mm256_sqrt_pd(a); }
+inline SimdDouble simdLess(SimdDouble a, SimdDouble b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+inline SimdDouble simdLessEqual(SimdDouble a, SimdDouble b) { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+inline SimdDouble simdAnd(SimdDouble a, SimdDouble b) { return _mm256_and_pd(a, b); }
+inline SimdDouble simdOr(SimdDouble a, SimdDouble b) { return _mm256_or_pd(a, b); }
+inline SimdDouble simdAndNot(SimdDouble a, SimdDouble b) { return _mm256_andnot_pd(a, b); }
+inline int simdMask(SimdDouble a) { return _mm256_movemask_pd(a); }
+inline SimdDouble simdFlags(const unsigned char* f) {
+	return _mm256_cmp_pd(_mm256_set_pd(f[3], f[2], f[1], f[0]),
+			_mm256_setzero_pd(), _CMP_NEQ_OQ);
+}
+#elif defined(__SSE2__) || defined(_M_X64)
+#define SIMD_WIDTH 2
+typedef __m128d SimdDouble;
+inline SimdDouble simdLoad(const double* p) { return _mm_loadu_pd(p); }
+inline void simdStore(double* p, SimdDouble a) { _mm_storeu_pd(p, a); }
+inline SimdDouble simdSet(double a) { return _mm_set1_pd(a); }
+inline SimdDouble simdAdd(SimdDouble a, SimdDouble b) { return _mm_add_pd(a, b); }
+inline SimdDouble simdSub(SimdDouble a, SimdDouble b) { return _mm_sub_pd(a, b); }
+inline SimdDouble simdMul(SimdDouble a, SimdDouble b) { return _mm_mul_pd(a, b); }
+inline SimdDouble simdDiv(SimdDouble a, SimdDouble b) { return _mm_div_pd(a, b); }
+inline SimdDouble simdSqrt(SimdDouble a) { return _mm_sqrt_pd(a); }
+inline SimdDouble simdLess(SimdDouble a, SimdDouble b) { return _mm_cmplt_pd(a, b); }
+inline SimdDouble simdLessEqual(SimdDouble a, SimdDouble b) { return _mm_cmple_pd(a, b); }
+inline SimdDouble simdAnd(SimdDouble a, SimdDouble b) { return _mm_and_pd(a, b); }
+inline SimdDouble simdOr(SimdDouble a, SimdDouble b) { return _mm_or_pd(a, b); }
+inline SimdDouble simdAndNot(SimdDouble a, SimdDouble b) { return _mm_andnot_pd(a, b); }
+inline int simdMask(SimdDouble a) { return _mm_movemask_pd(a); }
+inline SimdDouble simdFlags(const unsigned char* f) {
+	return _mm_cmpneq_pd(_mm_set_pd(f[1], f[0]), _mm_setzero_pd());
+}
+#else
+#define SIMD_WIDTH 1
+#endif
+
+#if defined(_MSC_VER)
+#define SIMD_RESTRICT __restrict
+#else
+#define SIMD_RESTRICT __restrict__
+#endif
+
+#if SIMD_WIDTH > 1
+// a where mask is set, b elsewhere
+inline SimdDouble simdSelect(SimdDouble mask, SimdDouble a, SimdDouble b) {
+	return simdOr(simdAnd(mask, a), simdAndNot(mask, b));
+}
+#endif
+
+// restitution of a ground bounce, along z and along the ground
+const double BOUNCE_DAMPING_Z = 0.8;
+const double BOUNCE_DAMPING_XY = 0.9;
+
+/**
+ * Positions and velocities of a batch of bodies. A body moves in a straight
+ * line at its velocity during a step, so where it was at the start of the
+ * last step is its position minus dt times its velocity, unless it bounced:
+ * then that is where it touched the ground.
+ */
+struct BodyArrays {
+	double* x;
+	double* y;
+	double* z;
+	double* vx;
+	double* vy;
+	double* vz;
+};
+
+/**
+ * Scalar version of stepBodies() for the bodies begin to end - 1.
+ */
+void stepBodiesScalar(BodyArrays& b, int begin, int end,
+		const unsigned char* active, double dt, unsigned char* bounced) {
+	// work on local copies, so that the stores do not make the compiler
+	// read the arrays and the constants back from memory
+	double* SIMD_RESTRICT x = b.x;
+	double* SIMD_RESTRICT y = b.y;
+	double* SIMD_RESTRICT z = b.z;
+	double* SIMD_RESTRICT vx = b.vx;
+	double* SIMD_RESTRICT vy = b.vy;
+	double* SIMD_RESTRICT vz = b.vz;
+	double gx = dt * GRAVITY.x;
+	double gy = dt * GRAVITY.y;
+	double gz = dt * GRAVITY.z;
+	double ground = groundZ;
+	for (int i = begin; i < end; i++) {
+		if (!active[i]) {
+			bounced[i] = 0;
+			continue;
+		}
+		double px = x[i];
+		double py = y[i];
+		double pz = z[i];
+		double ux = vx[i] + gx;
+		double uy = vy[i] + gy;
+		double uz = vz[i] + gz;
+
+		// onto the ground along the velocity, then reflect and damp
+		bool bounce = pz + uz * dt < ground && uz < 0;
+		if (bounce) {
+			double t = (ground - pz) / uz;
+			px += t * ux;
+			py += t * uy;
+			pz += t * uz;
+			uz = -uz * BOUNCE_DAMPING_Z;
+			ux = ux * BOUNCE_DAMPING_XY;
+			uy = uy * BOUNCE_DAMPING_XY;
+		}
+
+		x[i] = px + dt * ux;
+		y[i] = py + dt * uy;
+		z[i] = pz + dt * uz;
+		vx[i] = ux;
+		vy[i] = uy;
+		vz[i] = uz;
+		bounced[i] = bounce;
+	}
+}
+
+/**
+ * Advances the first n bodies that have their active flag set by dt with
+ * semi-implicit Euler: gravity, a damped bounce when the step would go
+ * through the ground, then the move. bounced[i] is set for every body
+ * that bounced, and cleared for the others.
+ */
+void stepBodies(BodyArrays& b, int n, const unsigned char* active,
+		double dt, unsigned char* bounced) {
+	int i = 0;
+#if SIMD_WIDTH > 1
+	double* SIMD_RESTRICT px = b.x;
+	double* SIMD_RESTRICT py = b.y;
+	double* SIMD_RESTRICT pz = b.z;
+	double* SIMD_RESTRICT pvx = b.vx;
+	double* SIMD_RESTRICT pvy = b.vy;
+	double* SIMD_RESTRICT pvz = b.vz;
+	const int allOn = (1 << SIMD_WIDTH) - 1;
+	SimdDouble step = simdSet(dt);
+	SimdDouble gx = simdSet(dt * GRAVITY.x);
+	SimdDouble gy = simdSet(dt * GRAVITY.y);
+	SimdDouble gz = simdSet(dt * GRAVITY.z);
+	SimdDouble ground = simdSet(groundZ);
+	SimdDouble zero = simdSet(0);
+	SimdDouble dampZ = simdSet(-BOUNCE_DAMPING_Z);
+	SimdDouble dampXY = simdSet(BOUNCE_DAMPING_XY);
+	for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+		SimdDouble on = simdFlags(active + i);
+		int onMask = simdMask(on);
+		if (onMask == 0) {
+			for (int j = 0; j < SIMD_WIDTH; j++) {
+				bounced[i + j] = 0;
+			}
+			continue;
+		}
+		SimdDouble x = simdLoad(px + i);
+		SimdDouble y = simdLoad(py + i);
+		SimdDouble z = simdLoad(pz + i);
+		SimdDouble vx = simdAdd(simdLoad(pvx + i), gx);
+		SimdDouble vy = simdAdd(simdLoad(pvy + i), gy);
+		SimdDouble vz = simdAdd(simdLoad(pvz + i), gz);
+
+		SimdDouble bounce = simdAnd(on, simdAnd(simdLess(simdAdd(z, simdMul(
+				vz, step)), ground), simdLess(vz, zero)));
+		int bounceMask = simdMask(bounce);
+		if (bounceMask != 0) {
+			SimdDouble t = simdAnd(bounce, simdDiv(simdSub(ground, z), vz));
+			x = simdAdd(x, simdMul(t, vx));
+			y = simdAdd(y, simdMul(t, vy));
+			z = simdAdd(z, simdMul(t, vz));
+			vz = simdSelect(bounce, simdMul(vz, dampZ), vz);
+			vx = simdSelect(bounce, simdMul(vx, dampXY), vx);
+			vy = simdSelect(bounce, simdMul(vy, dampXY), vy);
+		}
+		for (int j = 0; j < SIMD_WIDTH; j++) {
+			bounced[i + j] = (bounceMask >> j) & 1;
+		}
+
+		SimdDouble nx = simdAdd(x, simdMul(step, vx));
+		SimdDouble ny = simdAdd(y, simdMul(step, vy));
+		SimdDouble nz = simdAdd(z, simdMul(step, vz));
+		if (onMask != allOn) {
+			// inactive bodies keep what they had
+			nx = simdSelect(on, nx, simdLoad(px + i));
+			ny = simdSelect(on, ny, simdLoad(py + i));
+			nz = simdSelect(on, nz, simdLoad(pz + i));
+			vx = simdSelect(on, vx, simdLoad(pvx + i));
+			vy = simdSelect(on, vy, simdLoad(pvy + i));
+			vz = simdSelect(on, vz, simdLoad(pvz + i));
+		}
+		simdStore(px + i, nx);
+		simdStore(py + i, ny);
+		simdStore(pz + i, nz);
+		simdStore(pvx + i, vx);
+		simdStore(pvy + i, vy);
+		simdStore(pvz + i, vz);
+	}
+#endif
+	stepBodiesScalar(b, i, n, active, dt, bounced);
+}
+
+/**
+ * Scalar version of sweepSpheres() for the spheres begin to end - 1.
+ */
+void sweepSpheresScalar(const double* cx, const double* cy, const double* cz,
+		const double* radius, int begin, int end, const cVector3d& from,
+		const cVector3d& move, double sphereRadius, double* toi) {
+	double a = move.lengthsq();
+	for (int i = begin; i < end; i++) {
+		double sx = from.x - cx[i];
+		double sy = from.y - cy[i];
+		double sz = from.z - cz[i];
+		double r = radius[i] + sphereRadius;
+		double c = sx * sx + sy * sy + sz * sz - r * r;
+		double b = 2 * (sx * move.x + sy * move.y + sz * move.z);
+		double discriminant = b * b - 4 * a * c;
+		toi[i] = 2;
+		if (c <= 0) {
+			toi[i] = 0;
+		} else if (a != 0 && b < 0 && discriminant >= 0) {
+			double t = (-b - sqrt(discriminant)) / (2 * a);
+			if (t <= 1) {
+				toi[i] = t;
+			}
+		}
+	}
+}
+
+/**
+ * Sweeps a sphere from "from" along "move" against n spheres at once. For
+ * each, toi is how far along the way the first contact is (0 to 1), or 2
+ * if the spheres never touch. Spheres touching at the start get 0.
+ */
+void sweepSpheres(const double* cx, const double* cy, const double* cz,
+		const double* radius, int n, const cVector3d& from,
+		const cVector3d& move, double sphereRadius, double* toi) {
+	int i = 0;
+#if SIMD_WIDTH > 1
+	SimdDouble fx = simdSet(from.x);
+	SimdDouble fy = simdSet(from.y);
+	SimdDouble fz = simdSet(from.z);
+	SimdDouble mx = simdSet(move.x);
+	SimdDouble my = simdSet(move.y);
+	SimdDouble mz = simdSet(move.z);
+	double lengthSq = move.lengthsq();
+	SimdDouble a = simdSet(lengthSq);
+	SimdDouble twoA = simdSet(2 * lengthSq);
+	SimdDouble ownRadius = simdSet(sphereRadius);
+	SimdDouble zero = simdSet(0);
+	SimdDouble moving = simdLess(zero, a);
+	SimdDouble two = simdSet(2);
+	SimdDouble four = simdSet(4);
+	for (; i + SIMD_WIDTH <= n; i += SIMD_WIDTH) {
+		SimdDouble sx = simdSub(fx, simdLoad(cx + i));
+		SimdDouble sy = simdSub(fy, simdLoad(cy + i));
+		SimdDouble sz = simdSub(fz, simdLoad(cz + i));
+		SimdDouble r = simdAdd(simdLoad(radius + i), ownRadius);
+		SimdDouble c = simdSub(simdAdd(simdAdd(simdMul(sx, sx), simdMul(sy,
+				sy)), simdMul(sz, sz)), simdMul(r, r));
+		SimdDouble b = simdMul(two, simdAdd(simdAdd(simdMul(sx, mx), simdMul(
+				sy, my)), simdMul(sz, mz)));
+		SimdDouble discriminant = simdSub(simdMul(b, b), simdMul(four,
+				simdMul(a, c)));
+
+		// the root is only used where the discriminant is not negative
+		SimdDouble real = simdLessEqual(zero, discriminant);
+		SimdDouble t = simdDiv(simdSub(zero, simdAdd(b, simdSqrt(simdAnd(real,
+				discriminant)))), twoA);
+		SimdDouble hit = simdAnd(simdAnd(moving, real), simdAnd(simdLess(b,
+				zero), simdLessEqual(t, simdSet(1))));
+		SimdDouble inside = simdLessEqual(c, zero);
+		simdStore(toi + i, simdSelect(inside, zero, simdSelect(hit, t, two)));
+	}
+#endif
+	sweepSpheresScalar(cx, cy, cz, radius, i, n, from, move, sphereRadius, toi);
+}
+
+//////////////////////////////////////////
+// Target pool
+//////////////////////////////////////////
+/**
+ * The simulated targets of the current level, owned by the haptics thread.
+ * Every field is kept in its own array, so that loops over many targets
+ * only touch the fields they use. The pool is filled in place for every
+ * level and never allocates.
+ *
+ * Targets that stand still are sorted into a uniform grid when the level is
+ * set up, and the projectile is only tested against the grid cells around
+ * its path. Targets that move are kept in a separate list and are all
+ * tested every step.
+ */
+class TargetPool {
+public:
+	// the fields are public for the batched loops over all targets
+	int count;
+	double x[MAX_TARGETS];
+	double y[MAX_TARGETS];
+	double z[MAX_TARGETS];
+	double vx[MAX_TARGETS];
+	double vy[MAX_TARGETS];
+	double vz[MAX_TARGETS];
+	double radius[MAX_TARGETS];
+	cMatrix3d rot[MAX_TARGETS];
+	bool collided[MAX_TARGETS];
+	bool moving[MAX_TARGETS];
+
+private:
+	static const int GRID_BUCKETS = 1024;
+	// cells the grid looks at before testing all targets instead
+	static const int MAX_QUERY_CELLS = 64;
+	// below this many targets testing them all is faster than the grid
+	static const int GRID_MIN_TARGETS = 12;
+
+	int hitCount;
+	int movingList[MAX_TARGETS];
+	int movingCount;
+	cVector3d boundsMin;
+	cVector3d boundsMax;
+
+	// grid of the standing targets: the targets hashed to bucket b are
+	// bucketTargets[bucketStart[b]] to bucketTargets[bucketStart[b + 1] - 1]
+	double cellSize;
+	double largestRadius;
+	int bucketStart[GRID_BUCKETS + 1];
+	int bucketTargets[MAX_TARGETS];
+
+	// the targets touched first by the last sweep, more than one only if
+	// they are touched at exactly the same time
+	int firstTargets[MAX_TARGETS];
+	int firstCount;
+
+	int cellOf(double);
+	int bucketOf(int, int, int);
+	void buildGrid();
+	void startMoving(int);
+	cVector3d contactNormal(int, const cVector3d&, const cVector3d&, double);
+	void testTarget(int, const cVector3d&, const cVector3d&, double, int&,
+			double&, cVector3d&);
+	void hitFirst();
+
+public:
+	TargetPool();
+	void reset(const TargetDef*, const LevelDef&);
+	int sweep(const cVector3d&, const cVector3d&, double, double&,
+			cVector3d&);
+	int sweepAll(const cVector3d&, const cVector3d&, double, double&,
+			cVector3d&);
+	void hit(int, const cVector3d&);
+	void move(double);
+	bool isMoving() const;
+	bool allHit();
+	cVector3d getPos(int);
+};
+
+TargetPool::TargetPool() {
+	count = 0;
+	hitCount = 0;
+	movingCount = 0;
+	firstCount = 0;
+	cellSize = 1;
+	largestRadius = 0;
+	for (int i = 0; i <= GRID_BUCKETS; i++) {
+		bucketStart[i] = 0;
+	}
+}
+
+/**
+ * Sets up the targets of a level, defs holds level.targetCount targets.
+ */
+void TargetPool::reset(const TargetDef* defs, const LevelDef& level) {
+	count = level.targetCount;
+	hitCount = 0;
+	movingCount = 0;
+	boundsMin = level.boundsMin;
+	boundsMax = level.boundsMax;
+	for (int i = 0; i < count; i++) {
+		const TargetDef& def = defs[i];
+		x[i] = def.pos.x;
+		y[i] = def.pos.y;
+		z[i] = def.pos.z;
+		vx[i] = def.vel.x;
+		vy[i] = def.vel.y;
+		vz[i] = def.vel.z;
+		radius[i] = def.radius;
+		rot[i].identity();
+		if (def.angle != 0) {
+			rot[i].rotate(def.axis, def.angle);
+		}
+		collided[i] = false;
+		moving[i] = false;
+		if (vx[i] != 0 || vy[i] != 0 || vz[i] != 0) {
+			startMoving(i);
+		}
+	}
+	buildGrid();
+}
+
+int TargetPool::cellOf(double coordinate) {
+	return (int) floor(coordinate / cellSize);
+}
+
+/**
+ * Hashes a cell to its bucket. The products are unsigned, as signed ones
+ * would overflow for cells a few dozen away from the origin.
+ */
+int TargetPool::bucketOf(int cx, int cy, int cz) {
+	unsigned int hash = ((unsigned int) cx * 73856093u) ^ ((unsigned int) cy
+			* 19349663u) ^ ((unsigned int) cz * 83492791u);
+	return (int) (hash & (GRID_BUCKETS - 1));
+}
+
+/**
+ * Sorts the standing targets into the buckets of their centers. The cells
+ * are at least twice as wide as the largest target, so that a short path
+ * only has to look at a few cells around it.
+ */
+void TargetPool::buildGrid() {
+	largestRadius = 0;
+	for (int i = 0; i < count; i++) {
+		if (radius[i] > largestRadius) {
+			largestRadius = radius[i];
+		}
+	}
+	cellSize = 4 * largestRadius > 1 ? 4 * largestRadius : 1;
+
+	// count the targets of every bucket, then lay the buckets out one after
+	// the other and fill them
+	int bucket[MAX_TARGETS];
+	for (int b = 0; b <= GRID_BUCKETS; b++) {
+		bucketStart[b] = 0;
+	}
+	for (int i = 0; i < count; i++) {
+		if (!moving[i]) {
+			bucket[i] = bucketOf(cellOf(x[i]), cellOf(y[i]), cellOf(z[i]));
+			bucketStart[bucket[i] + 1]++;
+		}
+	}
+	for (int b = 0; b < GRID_BUCKETS; b++) {
+		bucketStart[b + 1] += bucketStart[b];
+	}
+	int filled[GRID_BUCKETS];
+	for (int b = 0; b < GRID_BUCKETS; b++) {
+		filled[b] = bucketStart[b];
+	}
+	for (int i = 0; i < count; i++) {
+		if (!moving[i]) {
+			bucketTargets[filled[bucket[i]]++] = i;
+		}
+	}
+}
+
+void TargetPool::startMoving(int i) {
+	if (!moving[i]) {
+		moving[i] = true;
+		movingList[movingCount++] = i;
+	}
+}
+
+/**
+ * Sweeps a sphere from "from" along "move" against target i, so that fast
+ * spheres cannot skip through it, and keeps the earliest hit in first,
+ * toi and normal (and in firstTargets). toi is how far along the way the
+ * first contact is (0 to 1) and normal points from the target to the
+ * sphere at that point.
+ */
+void TargetPool::testTarget(int i, const cVector3d& from,
+		const cVector3d& move, double sphereRadius, int& first, double& toi,
+		cVector3d& normal) {
+	cVector3d start(from.x - x[i], from.y - y[i], from.z - z[i]);
+	double r = radius[i] + sphereRadius;
+
+	// solve |start + t * move| = r for the first t
+	double t;
+	double c = start.lengthsq() - r * r;
+	if (c <= 0) {
+		// touching already at the start
+		t = 0;
+	} else {
+		double a = move.lengthsq();
+		double b = 2 * start.dot(move);
+		double discriminant = b * b - 4 * a * c;
+		if (a == 0 || b >= 0 || discriminant < 0) {
+			return;
+		}
+		t = (-b - sqrt(discriminant)) / (2 * a);
+		if (t > 1) {
+			return;
+		}
+	}
+
+	if (t < toi) {
+		first = i;
+		toi = t;
+		normal = contactNormal(i, from, move, t);
+		firstCount = 0;
+	}
+	if (t == toi) {
+		firstTargets[firstCount++] = i;
+	}
+}
+
+/**
+ * Counts the targets touched first by the last sweep as hit. The sphere
+ * bounces off them, so the targets further along its path are not reached.
+ */
+void TargetPool::hitFirst() {
+	for (int j = 0; j < firstCount; j++) {
+		int i = firstTargets[j];
+		if (!collided[i]) {
+			collided[i] = true;
+			hitCount++;
+		}
+	}
+}
+
+/**
+ * Direction from target i to a sphere that has moved t of the way along
+ * move from "from".
+ */
+cVector3d TargetPool::contactNormal(int i, const cVector3d& from,
+		const cVector3d& move, double t) {
+	cVector3d normal(from.x + t * move.x - x[i], from.y + t * move.y - y[i],
+			from.z + t * move.z - z[i]);
+	if (normal.lengthsq() > 0) {
+		normal.normalize();
+	} else {
+		normal = cVector3d(1, 0, 0);
+	}
+	return normal;
+}
+
+/**
+ * Finds the first target a sphere moving from "from" to "to" touches.
+ * Returns the target or -1, with toi and normal as for testTarget(). The
+ * first target touched counts as hit.
+ */
+int TargetPool::sweep(const cVector3d& from, const cVector3d& to,
+		double sphereRadius, double& toi, cVector3d& normal) {
+	// grid cells a target touching the path can have its center in
+	if (count < GRID_MIN_TARGETS) {
+		return sweepAll(from, to, sphereRadius, toi, normal);
+	}
+	double reach = largestRadius + sphereRadius;
+	int x0 = cellOf((from.x < to.x ? from.x : to.x) - reach);
+	int x1 = cellOf((from.x > to.x ? from.x : to.x) + reach);
+	int y0 = cellOf((from.y < to.y ? from.y : to.y) - reach);
+	int y1 = cellOf((from.y > to.y ? from.y : to.y) + reach);
+	int z0 = cellOf((from.z < to.z ? from.z : to.z) - reach);
+	int z1 = cellOf((from.z > to.z ? from.z : to.z) + reach);
+	double cells = (double) (x1 - x0 + 1) * (y1 - y0 + 1) * (z1 - z0 + 1);
+	if (cells > MAX_QUERY_CELLS) {
+		return sweepAll(from, to, sphereRadius, toi, normal);
+	}
+
+	cVector3d move = cSub(to, from);
+	int first = -1;
+	toi = 2;
+	firstCount = 0;
+
+	// cells can share a bucket, look at each bucket once
+	int visited[MAX_QUERY_CELLS];
+	int visitedCount = 0;
+	for (int cx = x0; cx <= x1; cx++) {
+		for (int cy = y0; cy <= y1; cy++) {
+			for (int cz = z0; cz <= z1; cz++) {
+				int b = bucketOf(cx, cy, cz);
+				bool seen = false;
+				for (int j = 0; j < visitedCount && !seen; j++) {
+					seen = visited[j] == b;
+				}
+				if (seen) {
+					continue;
+				}
+				visited[visitedCount++] = b;
+				for (int j = bucketStart[b]; j < bucketStart[b + 1]; j++) {
+					int i = bucketTargets[j];
+					if (!moving[i]) {
+						testTarget(i, from, move, sphereRadius, first, toi,
+								normal);
+					}
+				}
+			}
+		}
+	}
+
+	for (int j = 0; j < movingCount; j++) {
+		testTarget(movingList[j], from, move, sphereRadius, first, toi,
+				normal);
+	}
+	hitFirst();
+	return first;
+}
+
+/**
+ * Same as sweep(), testing every target with the batched kernel.
+ */
+int TargetPool::sweepAll(const cVector3d& from, const cVector3d& to,
+		double sphereRadius, double& toi, cVector3d& normal) {
+	cVector3d move = cSub(to, from);
+	double times[MAX_TARGETS];
+	sweepSpheres(x, y, z, radius, count, from, move, sphereRadius, times);
+
+	int first = -1;
+	toi = 2;
+	firstCount = 0;
+	for (int i = 0; i < count; i++) {
+		if (times[i] <= 1 && times[i] <= toi) {
+			if (times[i] < toi) {
+				first = i;
+				toi = times[i];
+				firstCount = 0;
+			}
+			firstTargets[firstCount++] = i;
+		}
+	}
+	if (first != -1) {
+		normal = contactNormal(first, from, move, toi);
+	}
+	hitFirst();
+	return first;
+}
+
+/**
+ * Knocks target i off with the given velocity.
+ */
+void TargetPool::hit(int i, const cVector3d& vel) {
+	vx[i] = vel.x;
+	vy[i] = vel.y;
+	vz[i] = vel.z;
+	startMoving(i);
+}
+
+/**
+ * Turns the velocity around if p has moved outside [min, max].
+ */
+void bounceInside(double p, double& v, double min, double max) {
+	if ((p < min && v < 0) || (p > max && v > 0)) {
+		v = -v;
+	}
+}
+
+void TargetPool::move(double dt) {
+	for (int j = 0; j < movingCount; j++) {
+		int i = movingList[j];
+		if (collided[i]) {
+			// knocked off, fall and tumble
+			vx[i] += dt * GRAVITY.x;
+			vy[i] += dt * GRAVITY.y;
+			vz[i] += dt * GRAVITY.z;
+			x[i] += dt * vx[i];
+			y[i] += dt * vy[i];
+			z[i] += dt * vz[i];
+			rot[i].rotate(cVector3d(threadRandom.uniform(),
+					threadRandom.uniform(), threadRandom.uniform()),
+					threadRandom.uniform() * 20 * dt);
+		} else {
+			// moving target, drift inside the level bounds
+			x[i] += dt * vx[i];
+			y[i] += dt * vy[i];
+			z[i] += dt * vz[i];
+			bounceInside(x[i], vx[i], boundsMin.x, boundsMax.x);
+			bounceInside(y[i], vy[i], boundsMin.y, boundsMax.y);
+			bounceInside(z[i], vz[i], boundsMin.z + radius[i], boundsMax.z);
+		}
+	}
+}
+
+/**
+ * Whether any target drifts, or falls and is not below the ground yet.
+ */
+bool TargetPool::isMoving() const {
+	for (int j = 0; j < movingCount; j++) {
+		int i = movingList[j];
+		if (!collided[i] || z[i] + radius[i] > groundZ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool TargetPool::allHit() {
+	return hitCount == count;
+}
+
+cVector3d TargetPool::getPos(int i) {
+	return cVector3d(x[i], y[i], z[i]);
+}
+
+//////////////////////////////////////////
+// Target visual class
+//////////////////////////////////////////
+/**
+ * The drawn part of a target, owned by the graphics thread. Visuals are
+ * never deleted: a new level places the ones it needs again and hides the
+ * rest.
+ */
+class TargetVisual {
+private:
+	CircleMesh* target;
+	cShapeLine* line;
+	cWorld* world;
+	bool hit;
+
+public:
+	TargetVisual(cWorld*, cVector3d, double);
+	void setColor(double, double, double);
+	void place(cVector3d, double);
+	void hide();
+	void showState(cVector3d, cMatrix3d, bool);
+	virtual ~TargetVisual();
+};
+
+TargetVisual::TargetVisual(cWorld *world, cVector3d pos, double radius) {
+	this->world = world;
+	target = new CircleMesh(world, pos, radius);
+	// create a line that runs to the floor
+	line = new cShapeLine(pos, pos);
+	world->addChild(line);
+	place(pos, radius);
+}
+
+void TargetVisual::setColor(double r, double g, double b) {
+	target->setColor(r, g, b);
+}
+
+/**
+ * Shows the visual as a fresh target at the start of a level.
+ */
+void TargetVisual::place(cVector3d pos, double radius) {
+	hit = false;
+	target->setPos(pos);
+	target->setRadius(radius);
+	cMatrix3d rot;
+	rot.identity();
+	target->setRot(rot);
+	target->setColor(0, 1, 0);
+	target->setShowEnabled(true);
+	line->m_pointA.set(pos.x, pos.y, groundZ);
+	line->m_pointB = pos;
+	line->setShowEnabled(true);
+}
+
+void TargetVisual::hide() {
+	target->setShowEnabled(false);
+	line->setShowEnabled(false);
+}
+
+/**
+ * Moves the mesh to a state published by the haptics thread.
+ */
+void TargetVisual::showState(cVector3d statePos, cMatrix3d stateRot,
+		bool stateHit) {
+	target->setPos(statePos);
+	target->setRot(stateRot);
+	if (stateHit) {
+		if (!hit) {
+			target->setColor(1, 0, 0);
+			hit = true;
+		}
+	} else {
+		// moving targets keep their line to the floor
+		line->m_pointA.set(statePos.x, statePos.y, groundZ);
+		line->m_pointB = statePos;
+	}
+}
+
+TargetVisual::~TargetVisual() {
+
+}
+
+//////////////////////////////////////////
+// Single producer, single consumer queue
+//////////////////////////////////////////
+/**
+ * Fixed size lock-free ring buffer between one producer thread and one
+ * consumer thread. push() fails instead of waiting when the queue is full.
+ * N must be a power of two.
+ */
+template<typename T, unsigned int N>
+class SpscQueue {
+private:
+	T items[N];
+	// next slot to read, written by the consumer
+	std::atomic<unsigned int> head;
+	// next slot to write, written by the producer
+	std::atomic<unsigned int> tail;
+public:
+	SpscQueue();
+	bool push(const T&);
+	bool pop(T&);
+};
+
+template<typename T, unsigned int N>
+SpscQueue<T, N>::SpscQueue() {
+	head = 0;
+	tail = 0;
+}
+
+template<typename T, unsigned int N>
+bool SpscQueue<T, N>::push(const T& item) {
+	unsigned int t = tail.load(std::memory_order_relaxed);
+	if (t - head.load(std::memory_order_acquire) == N) {
+		return false;
+	}
+	items[t % N] = item;
+	tail.store(t + 1, std::memory_order_release);
+	return true;
+}
+
+template<typename T, unsigned int N>
+bool SpscQueue<T, N>::pop(T& item) {
+	unsigned int h = head.load(std::memory_order_relaxed);
+	if (h == tail.load(std::memory_order_acquire)) {
+		return false;
+	}
+	item = items[h % N];
+	head.store(h + 1, std::memory_order_release);
+	return true;
+}
+
+//////////////////////////////////////////
+// Scene commands
+//////////////////////////////////////////
+// Scene graph changes requested by the haptics thread. They are carried out
+// by the graphics thread, so that the haptics thread never allocates or
+// touches the scene graph.
+enum SceneCommandType {
+	SCENE_SHOW_HOMERUN // value: 1 to show the homerun label, 0 to hide it
+};
+
+struct SceneCommand {
+	SceneCommandType type;
+	int value;
+};
+
+//////////////////////////////////////////
+// Hand prediction
+//////////////////////////////////////////
+// The camera and the device sphere are drawn where the hand is expected to
+// be when the frame reaches the screen, about a frame after the snapshot
+// it is drawn from. The haptics thread filters the device position and
+// hands the filter state over in the snapshot, and the graphics thread
+// extrapolates it to the display time.
+
+// fraction of the error the predictor corrects each tick, high enough to
+// follow the hand closely (beta and gamma follow from it)
+const double HAND_PREDICTOR_ALPHA = 0.2;
+// never predict further ahead than this, in seconds
+const double MAX_PREDICTION_TIME = 0.05;
+
+/**
+ * Position, velocity and acceleration of the hand at one tick.
+ */
+struct MotionState {
+	cVector3d pos;
+	cVector3d vel;
+	cVector3d acc;
+
+	cVector3d predict(double) const;
+};
+
+/**
+ * Where the hand will be the given number of seconds later, if it keeps
+ * accelerating the same way.
+ */
+cVector3d MotionState::predict(double ahead) const {
+	ahead = cClamp(ahead, 0.0, MAX_PREDICTION_TIME);
+	return cAdd(pos, cAdd(cMul(ahead, vel), cMul(0.5 * ahead * ahead, acc)));
+}
+
+/**
+ * Alpha-beta-gamma filter of the device position. Unlike the velocity
+ * estimator of the vibration it also tracks the acceleration and corrects
+ * more of the error each tick, since it is used to extrapolate, not to
+ * gate. beta and gamma are the steady state gains for alpha (Kalata).
+ */
+class MotionPredictor {
+private:
+	double alpha;
+	double beta;
+	double gamma;
+	MotionState state;
+	bool started;
+public:
+	MotionPredictor(double);
+	void update(const cVector3d&, double);
+	const MotionState& getState();
+};
+
+MotionPredictor::MotionPredictor(double alpha) :
+	alpha(alpha) {
+	beta = 2 * (2 - alpha) - 4 * sqrt(1 - alpha);
+	gamma = beta * beta / (2 * alpha);
+	state.pos.zero();
+	state.vel.zero();
+	state.acc.zero();
+	started = false;
+}
+
+/**
+ * Adds the position measured dt seconds after the last one.
+ */
+void MotionPredictor::update(const cVector3d& measured, double dt) {
+	if (!started) {
+		state.pos = measured;
+		started = true;
+		return;
+	}
+	if (dt <= 0) {
+		return;
+	}
+	cVector3d predicted = cAdd(state.pos, cAdd(cMul(dt, state.vel), cMul(0.5
+			* dt * dt, state.acc)));
+	state.vel.add(cMul(dt, state.acc));
+	cVector3d error = cSub(measured, predicted);
+	state.pos = cAdd(predicted, cMul(alpha, error));
+	state.vel.add(cMul(beta / dt, error));
+	state.acc.add(cMul(gamma / (dt * dt), error));
+}
+
+const MotionState& MotionPredictor::getState() {
+	return state;
+}
+
+// the device position in the virtual workspace (haptics thread)
+MotionPredictor handPredictor(HAND_PREDICTOR_ALPHA);
+
+// draw the hand where it is predicted to be ('p' key)
+bool predictHand = true;
+
+// time from a frame being drawn to it being shown, taken as the smoothed
+// frame period (graphics thread)
+double displayLatency = 1.0 / 60;
+long long lastFrameStart = 0;
+
+//////////////////////////////////////////
+// Simulation snapshot
+//////////////////////////////////////////
+// draw the scene between the last two ticks ('i' key)
+bool interpolateTicks = true;
+
+/**
+ * Where everything that moves is at one haptic tick.
+ */
+struct SimPose {
+	long long time; // nowNs() when it was published
+	int levelSerial;
+	unsigned int projectileGeneration[MAX_PROJECTILES];
+	cVector3d projectilePos[MAX_PROJECTILES];
+	cVector3d slingCenterPos;
+	int bandPointCount;
+	cVector3d bandPoints[2][MAX_BAND_POINTS];
+	int targetCount;
+	cVector3d targetPos[MAX_TARGETS];
+	cMatrix3d targetRot[MAX_TARGETS];
+
+	void copy(const SimPose&);
+};
+
+/**
+ * Copies the parts of a pose that are in use.
+ */
+void SimPose::copy(const SimPose& from) {
+	time = from.time;
+	levelSerial = from.levelSerial;
+	for (int i = 0; i < MAX_PROJECTILES; i++) {
+		projectileGeneration[i] = from.projectileGeneration[i];
+		projectilePos[i] = from.projectilePos[i];
+	}
+	slingCenterPos = from.slingCenterPos;
+	bandPointCount = from.bandPointCount;
+	for (int i = 0; i < bandPointCount; i++) {
+		bandPoints[0][i] = from.bandPoints[0][i];
+		bandPoints[1][i] = from.bandPoints[1][i];
+	}
+	targetCount = from.targetCount;
+	for (int i = 0; i < targetCount; i++) {
+		targetPos[i] = from.targetPos[i];
+		targetRot[i] = from.targetRot[i];
+	}
+}
+
+/**
+ * Everything the graphics thread needs from one haptic tick to draw the
+ * scene. It carries the pose of the tick before as well, so that the
+ * graphics can draw the time between the two ticks whatever the frame rate.
+ */
+struct SimSnapshot {
+	int level;
+	int levelSerial;
+	MotionState hand; // device position in the virtual workspace
+	bool projectileLive[MAX_PROJECTILES];
+	int latestProjectile;
+	int previewCount;
+	cVector3d previewPoints[MAX_PREVIEW_POINTS];
+	int targetCount;
+	double targetRadius[MAX_TARGETS];
+	bool targetHit[MAX_TARGETS];
+	SimPose pose;
+	SimPose previousPose;
+};
+
+/**
+ * Blends two rotations as quaternions, normalized after a linear blend
+ * (nlerp). Close enough to slerp for the small turn of one tick.
+ */
+cMatrix3d blendRotation(const cMatrix3d& a, const cMatrix3d& b, double f) {
+	const cMatrix3d* rot[2] = { &a, &b };
+	double q[2][4];
+	for (int k = 0; k < 2; k++) {
+		const double (*m)[3] = rot[k]->m;
+		double* r = q[k];
+		double trace = m[0][0] + m[1][1] + m[2][2];
+		if (trace > 0) {
+			double s = 2 * sqrt(trace + 1);
+			r[0] = s / 4;
+			r[1] = (m[2][1] - m[1][2]) / s;
+			r[2] = (m[0][2] - m[2][0]) / s;
+			r[3] = (m[1][0] - m[0][1]) / s;
+		} else if (m[0][0] > m[1][1] && m[0][0] > m[2][2]) {
+			double s = 2 * sqrt(1 + m[0][0] - m[1][1] - m[2][2]);
+			r[0] = (m[2][1] - m[1][2]) / s;
+			r[1] = s / 4;
+			r[2] = (m[0][1] + m[1][0]) / s;
+			r[3] = (m[0][2] + m[2][0]) / s;
+		} else if (m[1][1] > m[2][2]) {
+			double s = 2 * sqrt(1 + m[1][1] - m[0][0] - m[2][2]);
+			r[0] = (m[0][2] - m[2][0]) / s;
+			r[1] = (m[0][1] + m[1][0]) / s;
+			r[2] = s / 4;
+			r[3] = (m[1][2] + m[2][1]) / s;
+		} else {
+			double s = 2 * sqrt(1 + m[2][2] - m[0][0] - m[1][1]);
+			r[0] = (m[1][0] - m[0][1]) / s;
+			r[1] = (m[0][2] + m[2][0]) / s;
+			r[2] = (m[1][2] + m[2][1]) / s;
+			r[3] = s / 4;
+		}
+	}
+
+	// q and -q are the same rotation, take the shorter way
+	double dot = q[0][0] * q[1][0] + q[0][1] * q[1][1] + q[0][2] * q[1][2]
+			+ q[0][3] * q[1][3];
+	double fb = dot < 0 ? -f : f;
+	double w = (1 - f) * q[0][0] + fb * q[1][0];
+	double x = (1 - f) * q[0][1] + fb * q[1][1];
+	double y = (1 - f) * q[0][2] + fb * q[1][2];
+	double z = (1 - f) * q[0][3] + fb * q[1][3];
+	double length = sqrt(w * w + x * x + y * y + z * z);
+	w /= length;
+	x /= length;
+	y /= length;
+	z /= length;
+
+	cMatrix3d blended;
+	blended.set(1 - 2 * (y * y + z * z), 2 * (x * y - w * z), 2 * (x * z + w
+			* y), 2 * (x * y + w * z), 1 - 2 * (x * x + z * z), 2 * (y * z - w
+			* x), 2 * (x * z - w * y), 2 * (y * z + w * x), 1 - 2 * (x * x + y
+			* y));
+	return blended;
+}
+
+/**
+ * Triple buffer between the haptics thread (writer) and the graphics thread
+ * (reader). Each side owns one slot and the third is swapped atomically, so
+ * publishing never waits for the reader and the reader always gets the
+ * newest complete snapshot.
+ */
+class SnapshotBuffer {
+private:
+	SimSnapshot slots[3];
+	// index of the slot in the middle, SNAPSHOT_FRESH set if not read yet
+	std::atomic<int> middle;
+	int back;
+	int front;
+	static const int SNAPSHOT_FRESH = 4;
+public:
+	SnapshotBuffer();
+	SimSnapshot* writeSlot();
+	void publish();
+	bool update();
+	const SimSnapshot* readSlot();
+};
+
+SnapshotBuffer::SnapshotBuffer() {
+	back = 0;
+	middle = 1;
+	front = 2;
+}
+
+SimSnapshot* SnapshotBuffer::writeSlot() {
+	return &slots[back];
+}
+
+void SnapshotBuffer::publish() {
+	back = middle.exchange(back | SNAPSHOT_FRESH, std::memory_order_acq_rel)
+			& ~SNAPSHOT_FRESH;
+}
+
+/**
+ * Takes the newest published snapshot, returns false if nothing new has
+ * been published since the last call.
+ */
+bool SnapshotBuffer::update() {
+	if (!(middle.load(std::memory_order_relaxed) & SNAPSHOT_FRESH)) {
+		return false;
+	}
+	front = middle.exchange(front, std::memory_order_acq_rel)
+			& ~SNAPSHOT_FRESH;
+	return true;
+}
+
+const SimSnapshot* SnapshotBuffer::readSlot() {
+	return &slots[front];
+}
+
+// Targets (haptics thread) and their meshes (graphics thread). The meshes
+// are created when a level first needs them and then kept for reuse.
+TargetPool targetPool;
+TargetVisual* targetVisuals[MAX_TARGETS];
+int createdVisuals = 0;
+int shownTargets = 0;
+
+// level and level serial the target meshes were built for
+int shownLevel = -1;
+int shownSerial = -1;
+
+// scene graph changes waiting for the graphics thread
+SpscQueue<SceneCommand, 64> sceneCommands;
+
+// set by the 'n' key, the haptics thread switches level
+std::atomic<bool> nextLevelRequested(false);
+
+//////////////////////////////////////////
+// Telemetry
+//////////////////////////////////////////
+// Game events from the haptics thread. They are written to the session file
+// by a background thread, so the haptics thread never waits on stdio.
+enum TelemetryEventType {
+	EVENT_LEVEL_COMPLETE, // value: seconds spent on the level
+	EVENT_THROW, // position: release point, value: sling stretch
+	EVENT_TARGET_HIT, // position: point of impact, value: impact speed
+	EVENT_FORCE_SATURATION // position: requested force, value: its length
+};
+
+const char* TELEMETRY_EVENT_NAMES[] = { "level", "throw", "hit",
+		"saturation" };
+
+struct TelemetryEvent {
+	TelemetryEventType type;
+	int level;
+	int throwCount;
+	int target; // -1 if the event is not about a target
+	double time; // seconds since the level started
+	cVector3d pos;
+	double value;
+};
+
+// events waiting for the writer thread
+SpscQueue<TelemetryEvent, 4096> telemetryEvents;
+
+// events lost because the writer fell behind
+std::atomic<unsigned int> droppedEvents(0);
+
+// session file, NULL to only print completed levels on stdout
+FILE* sessionFile = NULL;
+
+// is the telemetry writer running, has it written its last event
+std::atomic<bool> telemetryRunning(false);
+std::atomic<bool> telemetryFinished(true);
+
+/**
+ * Queues an event from the haptics thread. Never blocks, the event is
+ * counted as dropped if the queue is full.
+ */
+void recordEvent(TelemetryEventType type, int target, const cVector3d& pos,
+		double value) {
+	TelemetryEvent event;
+	event.type = type;
+	event.level = level;
+	event.throwCount = thrownBalls;
+	event.target = target;
+	event.time = levelTimer;
+	event.pos = pos;
+	event.value = value;
+	if (!telemetryEvents.push(event)) {
+		droppedEvents.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+//////////////////////////////////////////
+// Sound
+//////////////////////////////////////////
+// Sound events from the haptics thread. The audio thread (or, headless,
+// the haptics loop itself) takes them at the start of every block it
+// mixes, so the haptics thread never waits on the sound output.
+enum SoundEventType {
+	SOUND_STRETCH, // value: sling stretch, 0 when let go
+	SOUND_RELEASE, // value: launch speed
+	SOUND_HIT, // value: impact speed
+	SOUND_BOUNCE, // value: speed into the ground
+	SOUND_TYPES
+};
+
+// the sounds, read from sounds/<name>.wav if there is such a file
+const char* SOUND_NAMES[SOUND_TYPES] = { "stretch", "release", "hit",
+		"bounce" };
+
+struct SoundEvent {
+	SoundEventType type;
+	double value;
+	long long time; // nowNs() when the event happened
+};
+
+// output format, 16 bit mono
+const int SOUND_RATE = 48000;
+// frames mixed at a time, and how far ahead the device may be fed
+const int SOUND_BLOCK = 128;
+const int SOUND_BUFFER_US = 8000;
+// sounds playing at the same time, the oldest one is cut off
+const int MAX_VOICES = 16;
+// the stretch of the sling bands is sent at most this often
+const double SOUND_STRETCH_INTERVAL = 0.01;
+
+// events waiting for the mixer
+SpscQueue<SoundEvent, 256> soundEvents;
+
+// time since the stretch was last sent (haptics thread)
+double stretchSoundTimer = SOUND_STRETCH_INTERVAL;
+
+// is the sound engine taking events
+std::atomic<bool> soundRunning(false);
+
+/**
+ * Queues a sound event from the haptics thread. Never blocks, the event is
+ * dropped if the queue is full or there is no sound.
+ */
+void playSound(SoundEventType type, double value) {
+	if (!soundRunning.load(std::memory_order_relaxed)) {
+		return;
+	}
+	SoundEvent event;
+	event.type = type;
+	event.value = value;
+	event.time = nowNs();
+	soundEvents.push(event);
+}
+
+/**
+ * Mixes the sound events into 16 bit samples. All clips are made or loaded
+ * and resampled to SOUND_RATE up front, so mixing a block only adds up
+ * samples. The stretch sound is a loop whose volume follows the sling.
+ */
+class SoundEngine {
+private:
+	struct Voice {
+		const vector<float>* clip;
+		size_t position;
+		float gain;
+	};
+
+	vector<float> clips[SOUND_TYPES];
+	Voice voices[MAX_VOICES];
+	int nextVoice;
+	size_t stretchPosition;
+	float stretchGain;
+	float stretchTarget;
+	float mixed[SOUND_BLOCK];
+
+	// offline output
+	FILE* wavFile;
+	long long wavFrames;
+	double wavPending;
+
+	void synthesize(SoundEventType, vector<float>&);
+	bool loadWav(const char*, vector<float>&);
+	void start(const SoundEvent&, long long);
+
+public:
+	// time from an event to when its sound is heard
+	TimingHistogram latency;
+
+	SoundEngine();
+	void load(const string&);
+	void mix(short*, int, long long);
+	bool openWav(const char*);
+	void renderWav(double);
+	void closeWav();
+};
+
+SoundEngine::SoundEngine() {
+	for (int i = 0; i < MAX_VOICES; i++) {
+		voices[i].clip = NULL;
+	}
+	nextVoice = 0;
+	stretchPosition = 0;
+	stretchGain = 0;
+	stretchTarget = 0;
+	wavFile = NULL;
+	wavFrames = 0;
+	wavPending = 0;
+}
+
+/**
+ * Reads the clips from the sounds directory under root, making up the ones
+ * that are not there.
+ */
+void SoundEngine::load(const string& root) {
+	for (int i = 0; i < SOUND_TYPES; i++) {
+		string file = root + "sounds/" + SOUND_NAMES[i] + ".wav";
+		if (!loadWav(file.c_str(), clips[i])) {
+			synthesize((SoundEventType) i, clips[i]);
+		}
+	}
+}
+
+/**
+ * The built-in sounds: a creaking band, the twang of the release, a jingle
+ * bell for a hit and a thud for a bounce.
+ */
+void SoundEngine::synthesize(SoundEventType type, vector<float>& clip) {
+	FastRandom random(type + 1);
+	double duration[SOUND_TYPES] = { 0.5, 0.35, 1.2, 0.15 };
+	int frames = (int) (duration[type] * SOUND_RATE);
+	clip.resize(frames);
+	double noise = 0;
+	for (int i = 0; i < frames; i++) {
+		double t = (double) i / SOUND_RATE;
+		double s = 0;
+		if (type == SOUND_STRETCH) {
+			// low-passed noise, loops without a click since it starts and
+			// ends near zero
+			noise += 0.05 * (2 * random.uniform() - 1 - noise);
+			s = 4 * noise * sin(M_PI * i / frames);
+		} else if (type == SOUND_RELEASE) {
+			// a plucked band dropping in pitch
+			double f = 160 + 120 * exp(-t * 20);
+			s = exp(-t * 12) * (sin(2 * M_PI * f * t) + 0.4 * sin(4 * M_PI * f
+					* t));
+		} else if (type == SOUND_HIT) {
+			// the partials of a small bell
+			const double partials[4] = { 1, 2.76, 5.40, 8.93 };
+			for (int p = 0; p < 4; p++) {
+				s += exp(-t * (3 + 2 * p)) * sin(2 * M_PI * 1100 * partials[p]
+						* t) / (p + 1);
+			}
+			s *= 0.6;
+		} else {
+			// a damped low tone with a bit of noise at the start
+			s = exp(-t * 30) * sin(2 * M_PI * 90 * t) + exp(-t * 200) * (2
+					* random.uniform() - 1) * 0.5;
+		}
+		clip[i] = (float) s;
+	}
+}
+
+/**
+ * Reads a 16 bit PCM WAV file, mixed down to mono and resampled to
+ * SOUND_RATE.
+ */
+bool SoundEngine::loadWav(const char* fileName, vector<float>& clip) {
+	FILE* file = fopen(fileName, "rb");
+	if (file == NULL) {
+		return false;
+	}
+	unsigned char header[12];
+	bool ok = fread(header, 1, 12, file) == 12 && memcmp(header, "RIFF", 4)
+			== 0 && memcmp(header + 8, "WAVE", 4) == 0;
+	int channels = 0;
+	int rate = 0;
+	int bits = 0;
+	vector<short> samples;
+	while (ok) {
+		unsigned char chunk[8];
+		if (fread(chunk, 1, 8, file) != 8) {
+			break;
+		}
+		unsigned int size = chunk[4] | chunk[5] << 8 | chunk[6] << 16
+				| (unsigned int) chunk[7] << 24;
+		if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16) {
+			unsigned char format[16];
+			ok = fread(format, 1, 16, file) == 16;
+			channels = format[2] | format[3] << 8;
+			rate = format[4] | format[5] << 8 | format[6] << 16 | format[7]
+					<< 24;
+			bits = format[14] | format[15] << 8;
+			fseek(file, size - 16 + (size & 1), SEEK_CUR);
+		} else if (memcmp(chunk, "data", 4) == 0) {
+			samples.resize(size / 2);
+			ok = fread(&samples[0], 2, samples.size(), file) == samples.size();
+			break;
+		} else {
+			fseek(file, size + (size & 1), SEEK_CUR);
+		}
+	}
+	fclose(file);
+	if (!ok || channels < 1 || rate <= 0 || bits != 16 || samples.empty()) {
+		printf("could not read sound %s, only 16 bit PCM is played\n",
+				fileName);
+		return false;
+	}
+
+	// linear interpolation to the output rate
+	size_t frames = samples.size() / channels;
+	size_t length = (size_t) ((double) frames * SOUND_RATE / rate);
+	clip.resize(length);
+	for (size_t i = 0; i < length; i++) {
+		double source = (double) i * rate / SOUND_RATE;
+		size_t a = (size_t) source;
+		size_t b = a + 1 < frames ? a + 1 : a;
+		double f = source - a;
+		double sa = 0;
+		double sb = 0;
+		for (int c = 0; c < channels; c++) {
+			sa += samples[a * channels + c];
+			sb += samples[b * channels + c];
+		}
+		clip[i] = (float) ((sa + f * (sb - sa)) / channels / 32768);
+	}
+	return true;
+}
+
+/**
+ * Starts the sound of an event. outputDelay is how long the block being
+ * mixed will wait in the output before it is heard.
+ */
+void SoundEngine::start(const SoundEvent& event, long long outputDelay) {
+	latency.add(nowNs() - event.time + outputDelay);
+	if (event.type == SOUND_STRETCH) {
+		stretchTarget = (float) cMin(event.value / 2, 1.0) * 0.3f;
+		return;
+	}
+
+	// louder for faster hits, soft bounces are left out
+	double gain = event.type == SOUND_RELEASE ? event.value / 10
+			: event.type == SOUND_HIT ? event.value / 8 : event.value / 5;
+	if (event.type == SOUND_BOUNCE && gain < 0.05) {
+		return;
+	}
+	Voice& voice = voices[nextVoice];
+	nextVoice = (nextVoice + 1) % MAX_VOICES;
+	voice.clip = &clips[event.type];
+	voice.position = 0;
+	voice.gain = (float) cMin(gain, 1.0);
+}
+
+/**
+ * Takes the waiting events and mixes the next frames into out.
+ */
+void SoundEngine::mix(short* out, int frames, long long outputDelay) {
+	SoundEvent event;
+	while (soundEvents.pop(event)) {
+		start(event, outputDelay);
+	}
+
+	for (int done = 0; done < frames; done += SOUND_BLOCK) {
+		int n = frames - done < SOUND_BLOCK ? frames - done : SOUND_BLOCK;
+
+		// the stretch loop glides to its new volume
+		const vector<float>& loop = clips[SOUND_STRETCH];
+		float glide = 0.002f;
+		for (int i = 0; i < n; i++) {
+			stretchGain += glide * (stretchTarget - stretchGain);
+			mixed[i] = stretchGain * loop[stretchPosition];
+			stretchPosition = (stretchPosition + 1) % loop.size();
+		}
+
+		for (int v = 0; v < MAX_VOICES; v++) {
+			Voice& voice = voices[v];
+			if (voice.clip == NULL) {
+				continue;
+			}
+			const float* clip = &(*voice.clip)[0];
+			size_t left = voice.clip->size() - voice.position;
+			int count = left < (size_t) n ? (int) left : n;
+			for (int i = 0; i < count; i++) {
+				mixed[i] += voice.gain * clip[voice.position + i];
+			}
+			voice.position += count;
+			if (voice.position == voice.clip->size()) {
+				voice.clip = NULL;
+			}
+		}
+
+		for (int i = 0; i < n; i++) {
+			float s = mixed[i] * 0.5f;
+			s = s > 1 ? 1 : s < -1 ? -1 : s;
+			out[done + i] = (short) (s * 32767);
+		}
+	}
+}
+
+/**
+ * Starts writing the sound to a WAV file instead of a device. The sizes
+ * in the header are filled in by closeWav().
+ */
+bool SoundEngine::openWav(const char* fileName) {
+	wavFile = fopen(fileName, "wb");
+	if (wavFile == NULL) {
+		return false;
+	}
+	unsigned char header[44] = { 'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'A',
+			'V', 'E', 'f', 'm', 't', ' ', 16, 0, 0, 0, 1, 0, 1, 0,
+			SOUND_RATE & 0xff, (SOUND_RATE >> 8) & 0xff, SOUND_RATE >> 16, 0,
+			(2 * SOUND_RATE) & 0xff, ((2 * SOUND_RATE) >> 8) & 0xff, (2
+					* SOUND_RATE) >> 16, 0, 2, 0, 16, 0, 'd', 'a', 't', 'a', 0,
+			0, 0, 0 };
+	fwrite(header, 1, sizeof(header), wavFile);
+	wavFrames = 0;
+	wavPending = 0;
+	return true;
+}
+
+/**
+ * Mixes the given simulated time into the WAV file, in whole frames.
+ */
+void SoundEngine::renderWav(double seconds) {
+	if (wavFile == NULL) {
+		return;
+	}
+	wavPending += seconds * SOUND_RATE;
+	int frames = (int) wavPending;
+	wavPending -= frames;
+	short samples[SOUND_BLOCK];
+	while (frames > 0) {
+		int n = frames < SOUND_BLOCK ? frames : SOUND_BLOCK;
+		mix(samples, n, 0);
+		fwrite(samples, sizeof(short), n, wavFile);
+		wavFrames += n;
+		frames -= n;
+	}
+}
+
+void SoundEngine::closeWav() {
+	if (wavFile == NULL) {
+		return;
+	}
+	unsigned int data = (unsigned int) (wavFrames * 2);
+	unsigned int riff = data + 36;
+	unsigned char size[4];
+	for (int i = 0; i < 4; i++) {
+		size[i] = (riff >> (8 * i)) & 0xff;
+	}
+	fseek(wavFile, 4, SEEK_SET);
+	fwrite(size, 1, 4, wavFile);
+	for (int i = 0; i < 4; i++) {
+		size[i] = (data >> (8 * i)) & 0xff;
+	}
+	fseek(wavFile, 40, SEEK_SET);
+	fwrite(size, 1, 4, wavFile);
+	fclose(wavFile);
+	wavFile = NULL;
+	printf("sound: %.1f s written\n", (double) wavFrames / SOUND_RATE);
+}
+
+// the sound engine, NULL if there is no sound
+SoundEngine* soundEngine = NULL;
+
+// has the audio thread stopped
+std::atomic<bool> soundFinished(true);
+
+//////////////////////////////////////////
+// Hand velocity
+//////////////////////////////////////////
+/**
+ * Alpha-beta filter of the device position. Every tick predicts the
+ * position from the last estimate and corrects the position and the
+ * velocity by fixed fractions of the error, so the velocity is smoothed over
+ * about 1 / alpha ticks at a constant cost, instead of being the noisy
+ * difference of the last two samples. beta = alpha^2 / (2 - alpha) is the
+ * Benedict-Bordner choice, which trades noise against lag when following
+ * a hand that speeds up.
+ */
+class VelocityEstimator {
+private:
+	double alpha;
+	double beta;
+	cVector3d pos;
+	cVector3d vel;
+	bool started;
+public:
+	VelocityEstimator(double);
+	void update(const cVector3d&, double);
+	cVector3d getVelocity();
+	double getSpeed();
+};
+
+VelocityEstimator::VelocityEstimator(double alpha) :
+	alpha(alpha) {
+	beta = alpha * alpha / (2 - alpha);
+	pos.zero();
+	vel.zero();
+	started = false;
+}
+
+/**
+ * Adds the position measured dt seconds after the last one.
+ */
+void VelocityEstimator::update(const cVector3d& measured, double dt) {
+	if (!started) {
+		pos = measured;
+		started = true;
+		return;
+	}
+	if (dt <= 0) {
+		return;
+	}
+	cVector3d predicted = cAdd(pos, cMul(dt, vel));
+	cVector3d error = cSub(measured, predicted);
+	pos = cAdd(predicted, cMul(alpha, error));
+	vel.add(cMul(beta / dt, error));
+}
+
+cVector3d VelocityEstimator::getVelocity() {
+	return vel;
+}
+
+double VelocityEstimator::getSpeed() {
+	return vel.length();
+}
+
+/**
+ * 0 below edge0, 1 above edge1 and a smooth step in between.
+ */
+double smoothstep(double edge0, double edge1, double x) {
+	double t = cClamp((x - edge0) / (edge1 - edge0), 0.0, 1.0);
+	return t * t * (3 - 2 * t);
+}
+
+// velocity of the device in the virtual workspace (haptics thread)
+VelocityEstimator handVelocity(handFilterAlpha);
+
+//////////////////////////////////////////
+// Sling bands
+//////////////////////////////////////////
+// segments of each sling band
+const int BAND_SEGMENTS = 64;
+// mass of a whole band, and the damping between two neighbouring points
+const double BAND_MASS = 0.02;
+const double BAND_DAMPING = 0.5;
+
+/**
+ * A sling band as a chain of point masses from a pole top to the sling
+ * center, with every coordinate in its own array. The springs between the
+ * points have no rest length, like a stretched rubber band, so the forces
+ * are linear and the axes do not mix. A step is implicit Euler: one
+ * tridiagonal system for the new velocities, the same for all three axes,
+ * solved with the Thomas algorithm. The matrix only depends on the time
+ * step, so its elimination factors are computed once.
+ */
+class SlingBand {
+	int segments;
+	// spring between two neighbouring points and the mass of a point
+	double stiffness;
+	double mass;
+	std::vector<double> x;
+	std::vector<double> y;
+	std::vector<double> z;
+	std::vector<double> vx;
+	std::vector<double> vy;
+	std::vector<double> vz;
+
+	// elimination factors for factorStep
+	double factorStep;
+	double coupling;
+	std::vector<double> upper;
+	std::vector<double> pivot;
+	std::vector<double> solved;
+
+	void factor(double);
+	void solveAxis(double*, double*, double, double, double, double);
+
+public:
+	SlingBand(int, const cVector3d&);
+	void step(const cVector3d&, const cVector3d&, double);
+	cVector3d getForce();
+	int getPointCount();
+	cVector3d getPoint(int);
+};
+
+/**
+ * A band of the given number of segments, hanging straight from start to
+ * the sling center. At rest it pulls the sling towards start with half of
+ * slingSpringConst, the two bands together with all of it.
+ */
+SlingBand::SlingBand(int n, const cVector3d& start) :
+	segments(n), x(n + 1), y(n + 1), z(n + 1), vx(n + 1, 0), vy(n + 1, 0),
+			vz(n + 1, 0), upper(n + 1), pivot(n + 1), solved(n + 1) {
+	stiffness = n * slingSpringConst / 2;
+	mass = BAND_MASS / n;
+	factorStep = 0;
+	for (int i = 0; i <= n; i++) {
+		double t = (double) i / n;
+		x[i] = start.x + t * (slingCenterPos.x - start.x);
+		y[i] = start.y + t * (slingCenterPos.y - start.y);
+		z[i] = start.z + t * (slingCenterPos.z - start.z);
+	}
+}
+
+/**
+ * Forward elimination of the velocity system of a step of dt for the
+ * inner points 1 to segments - 1:
+ * (m + 2a) v'[i] - a v'[i - 1] - a v'[i + 1] = rhs[i], a = dt^2 k + dt c.
+ */
+void SlingBand::factor(double dt) {
+	factorStep = dt;
+	coupling = dt * dt * stiffness + dt * BAND_DAMPING;
+	double diagonal = mass + 2 * coupling;
+	double previous = 0;
+	for (int i = 1; i < segments; i++) {
+		pivot[i] = 1 / (diagonal + coupling * previous);
+		upper[i] = -coupling * pivot[i];
+		previous = upper[i];
+	}
+}
+
+/**
+ * One axis of a step: p and v are the positions and velocities of the
+ * points, start and end where the two ends of the band go in this step.
+ */
+void SlingBand::solveAxis(double* p, double* v, double start, double end,
+		double g, double dt) {
+	double startVel = (start - p[0]) / dt;
+	double endVel = (end - p[segments]) / dt;
+
+	// forward, with the ends moved to the right hand side
+	double previous = 0;
+	for (int i = 1; i < segments; i++) {
+		double rhs = mass * (v[i] + dt * g) + dt * stiffness * (p[i - 1]
+				+ p[i + 1] - 2 * p[i]);
+		if (i == 1) {
+			rhs += coupling * startVel;
+		}
+		if (i == segments - 1) {
+			rhs += coupling * endVel;
+		}
+		solved[i] = (rhs + coupling * previous) * pivot[i];
+		previous = solved[i];
+	}
+
+	// and back
+	double next = 0;
+	for (int i = segments - 1; i >= 1; i--) {
+		v[i] = solved[i] - upper[i] * next;
+		next = v[i];
+	}
+	for (int i = 1; i < segments; i++) {
+		p[i] += dt * v[i];
+	}
+	v[0] = startVel;
+	v[segments] = endVel;
+	p[0] = start;
+	p[segments] = end;
+}
+
+/**
+ * Moves the band dt seconds forward, with its ends going to start and end.
+ */
+void SlingBand::step(const cVector3d& start, const cVector3d& end, double dt) {
+	if (dt != factorStep) {
+		factor(dt);
+	}
+	solveAxis(&x[0], &vx[0], start.x, end.x, GRAVITY.x, dt);
+	solveAxis(&y[0], &vy[0], start.y, end.y, GRAVITY.y, dt);
+	solveAxis(&z[0], &vz[0], start.z, end.z, GRAVITY.z, dt);
+}
+
+/**
+ * The pull of the band on the sling center.
+ */
+cVector3d SlingBand::getForce() {
+	int n = segments;
+	return cVector3d(stiffness * (x[n - 1] - x[n]), stiffness * (y[n - 1]
+			- y[n]), stiffness * (z[n - 1] - z[n]));
+}
+
+int SlingBand::getPointCount() {
+	return segments + 1;
+}
+
+cVector3d SlingBand::getPoint(int i) {
+	return cVector3d(x[i], y[i], z[i]);
+}
+
+// the two sling bands (haptics thread)
+SlingBand slingBand(BAND_SEGMENTS, poleTopPos);
+SlingBand slingBand2(BAND_SEGMENTS, poleTopPos2);
+
+//////////////////////////////////////////
+// Projectile pool
+//////////////////////////////////////////
+// What a projectile in the pool is doing
+enum ProjectileState {
+	PROJECTILE_FREE, // not in use
+	PROJECTILE_HELD, // in the sling, follows the device
+	PROJECTILE_FLYING, // thrown, under gravity
+	PROJECTILE_RESTING // lying still on the ground
+};
+
+// a projectile slower than this after a bounce stops on the ground
+const double REST_SPEED = 0.05;
+
+/**
+ * Where the sling bands let go of a projectile released at pullBack, and
+ * how fast it goes then. The two bands pull it towards their pole tops,
+ * which together with gravity makes a spring towards a point e between the
+ * poles, a little below them: p(t) = e + (p0 - e) cos wt. The bands let go
+ * when the projectile is closest to the sling center (the origin), where
+ * p(t) . v(t) turns positive, that is when cos wt = -e . (p0 - e) /
+ * |p0 - e|^2.
+ */
+void launchProjectile(const cVector3d& pullBack, cVector3d& pos,
+		cVector3d& vel) {
+	double k = slingLaunchStiffness / projectileMass;
+	double omega = sqrt(2 * k);
+	cVector3d rest = cAdd(cMul(0.5, cAdd(poleTopPos, poleTopPos2)), cMul(0.5
+			/ k, GRAVITY));
+	cVector3d offset = cSub(pullBack, rest);
+	double length = offset.lengthsq();
+	double cosine = length > 0 ? cClamp(-rest.dot(offset) / length, -1.0, 1.0)
+			: 1.0;
+	double sine = sqrt(1 - cosine * cosine);
+	pos = cAdd(rest, cMul(cosine, offset));
+	vel = cMul(-omega * sine, offset);
+}
+
+/**
+ * All projectiles in play, owned by the haptics thread, with every field in
+ * its own array. A new throw takes the slot of the oldest projectile, so
+ * the player can fire volleys without waiting for the last throw to land.
+ * The physics go over all projectiles in one pass per step, and resting
+ * projectiles drop out of it.
+ */
+class ProjectilePool {
+public:
+	// the fields are public for the batched loops over all projectiles
+	double x[MAX_PROJECTILES];
+	double y[MAX_PROJECTILES];
+	double z[MAX_PROJECTILES];
+	double vx[MAX_PROJECTILES];
+	double vy[MAX_PROJECTILES];
+	double vz[MAX_PROJECTILES];
+	double radius[MAX_PROJECTILES];
+	unsigned char state[MAX_PROJECTILES];
+	// has the projectile bounced off a target since it was thrown
+	bool collided[MAX_PROJECTILES];
+	// did the projectile bounce on the ground in the last step
+	unsigned char bounced[MAX_PROJECTILES];
+	// where the projectile was at the start of the last step
+	double startX[MAX_PROJECTILES];
+	double startY[MAX_PROJECTILES];
+	double startZ[MAX_PROJECTILES];
+	// counts the projectiles that took the slot, so that the graphics do not
+	// blend one into the next
+	unsigned int generation[MAX_PROJECTILES];
+
+private:
+	// are target hits written to the telemetry
+	bool recording;
+	int held;
+	int latest;
+	int next;
+
+public:
+	ProjectilePool();
+	void clear();
+	void hold(const cVector3d&, double);
+	int release();
+	void move(double);
+	void collide(TargetPool&, double);
+	void setRecording(bool);
+	bool isLive(int);
+	int getLatest();
+	cVector3d getPos(int);
+	cVector3d getVel(int);
+};
+
+ProjectilePool::ProjectilePool() {
+	recording = true;
+	for (int i = 0; i < MAX_PROJECTILES; i++) {
+		generation[i] = 0;
+	}
+	clear();
+}
+
+void ProjectilePool::clear() {
+	for (int i = 0; i < MAX_PROJECTILES; i++) {
+		state[i] = PROJECTILE_FREE;
+		x[i] = y[i] = z[i] = 0;
+		vx[i] = vy[i] = vz[i] = 0;
+		radius[i] = 0;
+		collided[i] = false;
+		bounced[i] = 0;
+		generation[i]++;
+	}
+	held = -1;
+	latest = -1;
+	next = 0;
+}
+
+/**
+ * Puts the held projectile in the sling at pos, taking a new one if none
+ * is held.
+ */
+void ProjectilePool::hold(const cVector3d& pos, double r) {
+	if (held == -1) {
+		held = next;
+		latest = next;
+		next = (next + 1) % MAX_PROJECTILES;
+		state[held] = PROJECTILE_HELD;
+		radius[held] = r;
+		collided[held] = false;
+		generation[held]++;
+	}
+	x[held] = pos.x;
+	y[held] = pos.y;
+	z[held] = pos.z;
+	vx[held] = vy[held] = vz[held] = 0;
+}
+
+/**
+ * Fires the held projectile: it leaves the sling bands right away, where
+ * and as fast as launchProjectile() says. Returns it, or -1 if no
+ * projectile was held.
+ */
+int ProjectilePool::release() {
+	int thrown = held;
+	if (thrown != -1) {
+		cVector3d pos;
+		cVector3d vel;
+		launchProjectile(getPos(thrown), pos, vel); // ååh förlååååt förlååååååååt!!!
+		x[thrown] = pos.x;
+		y[thrown] = pos.y;
+		z[thrown] = pos.z;
+		vx[thrown] = vel.x;
+		vy[thrown] = vel.y;
+		vz[thrown] = vel.z;
+		state[thrown] = PROJECTILE_FLYING;
+		held = -1;
+	}
+	return thrown;
+}
+
+/**
+ * Moves every flying projectile dt seconds forward, all of them at once
+ * with the trajectory kernel.
+ */
+void ProjectilePool::move(double dt) {
+	unsigned char active[MAX_PROJECTILES];
+	for (int i = 0; i < MAX_PROJECTILES; i++) {
+		active[i] = state[i] == PROJECTILE_FLYING;
+		startX[i] = x[i];
+		startY[i] = y[i];
+		startZ[i] = z[i];
+	}
+
+	// Add gravitational acceleration to projectile - it's flying away bro
+	BodyArrays bodies = { x, y, z, vx, vy, vz };
+	stepBodies(bodies, MAX_PROJECTILES, active, dt, bounced);
+
+	// a projectile that hardly bounces any more stays on the ground
+	for (int i = 0; i < MAX_PROJECTILES; i++) {
+		if (bounced[i] && recording) {
+			playSound(SOUND_BOUNCE, vz[i]);
+		}
+		if (bounced[i] && vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i]
+				< REST_SPEED * REST_SPEED) {
+			state[i] = PROJECTILE_RESTING;
+			x[i] -= dt * vx[i];
+			y[i] -= dt * vy[i];
+			z[i] = groundZ;
+			vx[i] = vy[i] = vz[i] = 0;
+		}
+	}
+}
+
+/**
+ * Tests the last step (of dt seconds) of every moving projectile against
+ * the targets. A projectile bounces off the first target it hits after a
+ * throw. A step that bounced on the ground is tested as its two parts,
+ * down to the ground and up from there.
+ */
+void ProjectilePool::collide(TargetPool& targets, double dt) {
+	for (int i = 0; i < MAX_PROJECTILES; i++) {
+		if (state[i] != PROJECTILE_FLYING) {
+			continue;
+		}
+
+		cVector3d from(startX[i], startY[i], startZ[i]);
+		cVector3d to(x[i], y[i], z[i]);
+		double hitTime;
+		cVector3d hitNormal;
+		int hitTarget = -1;
+		if (bounced[i]) {
+			cVector3d ground(x[i] - dt * vx[i], y[i] - dt * vy[i], z[i] - dt
+					* vz[i]);
+			hitTarget = targets.sweep(from, ground, radius[i], hitTime,
+					hitNormal);
+			if (hitTarget != -1) {
+				// hit on the way down, with the velocity from before the
+				// bounce
+				to = ground;
+				if (!collided[i]) {
+					vx[i] /= BOUNCE_DAMPING_XY;
+					vy[i] /= BOUNCE_DAMPING_XY;
+					vz[i] /= -BOUNCE_DAMPING_Z;
+				}
+			} else {
+				from = ground;
+			}
+		}
+		if (hitTarget == -1) {
+			hitTarget = targets.sweep(from, to, radius[i], hitTime, hitNormal);
+		}
+		if (hitTarget == -1 || collided[i]) {
+			continue;
+		}
+
+		// back to the point of impact
+		x[i] = from.x + hitTime * (to.x - from.x);
+		y[i] = from.y + hitTime * (to.y - from.y);
+		z[i] = from.z + hitTime * (to.z - from.z);
+		cVector3d vel(vx[i], vy[i], vz[i]);
+		targets.hit(hitTarget, vel);
+		if (recording) {
+			recordEvent(EVENT_TARGET_HIT, hitTarget, getPos(i), vel.length());
+			playSound(SOUND_HIT, vel.length());
+		}
+
+		// mirror the velocity in the contact plane, losing some speed
+		double normalSpeed = vel.dot(hitNormal);
+		if (normalSpeed < 0) {
+			vel.sub(cMul(2 * normalSpeed, hitNormal));
+		}
+		vx[i] = vel.x * 0.6;
+		vy[i] = vel.y * 0.6;
+		vz[i] = vel.z * 0.6;
+		collided[i] = true;
+	}
+}
+
+/**
+ * Turns the telemetry of target hits on or off, it is off for the pools of
+ * simulated throws.
+ */
+void ProjectilePool::setRecording(bool on) {
+	recording = on;
+}
+
+bool ProjectilePool::isLive(int i) {
+	return state[i] != PROJECTILE_FREE;
+}
+
+/**
+ * The projectile taken last, or -1 if there is none.
+ */
+int ProjectilePool::getLatest() {
+	return latest;
+}
+
+cVector3d ProjectilePool::getPos(int i) {
+	return cVector3d(x[i], y[i], z[i]);
+}
+
+cVector3d ProjectilePool::getVel(int i) {
+	return cVector3d(vx[i], vy[i], vz[i]);
+}
+
+// the projectiles in play (haptics thread)
+ProjectilePool projectilePool;
+
+//////////////////////////////////////////
+// Aim preview
+//////////////////////////////////////////
+// physics steps the preview advances every haptics tick
+const int PREVIEW_STEPS_PER_TICK = 200;
+// the preview starts over when the smoothed aim moves farther than this,
+// several times what device noise moves it
+const double PREVIEW_TOLERANCE = 0.005;
+// longest previewed flight
+const double PREVIEW_FLIGHT_TIME = 5.0;
+// flight time between two points of the arc, so that the longest flight
+// fits in MAX_PREVIEW_POINTS
+const double PREVIEW_RECORD_INTERVAL = 0.02;
+
+/**
+ * The path a projectile released at the aim would take, up to where it
+ * first touches a target or the ground. The preview throws the projectile
+ * of a pool of its own against a copy of the targets, so it takes the same
+ * launch, the same steps and the same collision test as a real throw, and
+ * moving targets move along. It is advanced a few steps every haptics tick
+ * and starts over when the aim moves. While targets of the game move, a
+ * finished preview is run again to follow them, and the arc shown keeps its
+ * old end until the new run gets there. The real throw is released from the
+ * aim of the preview, so it flies the arc shown.
+ */
+class AimPreview {
+	ProjectilePool pool;
+	TargetPool targets;
+	int thrown;
+	int steps;
+	int recordSteps;
+	int building;
+	cVector3d aim;
+	bool done;
+
+	void start(const TargetPool&);
+	void addPoint(const cVector3d&);
+
+public:
+	int count;
+	cVector3d points[MAX_PREVIEW_POINTS];
+
+	AimPreview();
+	void clear();
+	void update(const cVector3d&, const TargetPool&, double);
+	bool getAim(cVector3d&);
+};
+
+AimPreview::AimPreview() {
+	pool.setRecording(false);
+	clear();
+}
+
+void AimPreview::clear() {
+	count = 0;
+	building = 0;
+	done = true;
+}
+
+/**
+ * Throws the projectile of the preview from the aim again.
+ */
+void AimPreview::start(const TargetPool& current) {
+	targets = current;
+	pool.clear();
+	pool.hold(aim, projectileRadius);
+	thrown = pool.release();
+	steps = 0;
+	building = 0;
+	done = false;
+	addPoint(aim);
+}
+
+void AimPreview::addPoint(const cVector3d& point) {
+	points[building++] = point;
+	done = done || building == MAX_PREVIEW_POINTS;
+	count = done ? building : cMax(count, building);
+}
+
+/**
+ * Moves the preview of a throw released at pos, the smoothed hand
+ * position, on by up to PREVIEW_STEPS_PER_TICK steps of dt. Starts over
+ * when pos moves farther than PREVIEW_TOLERANCE from the aim.
+ */
+void AimPreview::update(const cVector3d& pos, const TargetPool& current,
+		double dt) {
+	if (count == 0 || cSub(pos, aim).length() > PREVIEW_TOLERANCE) {
+		aim = pos;
+		count = 0;
+		start(current);
+	} else if (done && current.isMoving()) {
+		start(current);
+	}
+	recordSteps = (int) ceil(PREVIEW_RECORD_INTERVAL / dt);
+
+	for (int s = 0; s < PREVIEW_STEPS_PER_TICK && !done; s++) {
+		// the same order as a tick of the game
+		pool.move(dt);
+		pool.collide(targets, dt);
+		targets.move(dt);
+		steps++;
+		int i = thrown;
+
+		cVector3d to(pool.x[i], pool.y[i], pool.z[i]);
+		if (pool.collided[i] || pool.bounced[i] || steps * dt
+				> PREVIEW_FLIGHT_TIME) {
+			// a hit leaves the projectile at the point of impact
+			done = true;
+			addPoint(to);
+		} else if (steps % recordSteps == 0) {
+			addPoint(to);
+		}
+	}
+}
+
+/**
+ * Gets the position the preview throws from, false if there is none.
+ */
+bool AimPreview::getAim(cVector3d& pos) {
+	if (count == 0) {
+		return false;
+	}
+	pos = aim;
+	return true;
+}
+
+// the aim preview shown while the sling is pulled (haptics thread)
+AimPreview aimPreview;
+
+//////////////////////////////////////////
+// Level solver
+//////////////////////////////////////////
+// The solver (--solve) throws a projectile from every point of a grid of
+// pull-backs with the projectile pool and target pool of the game, and
+// finds the fewest throws that hit every target of a level. Each throw is
+// simulated on its own against the level as it is set up, so a knocked off
+// target does not change the next throw and moving targets start where the
+// level puts them.
+
+// pull-backs per axis of the grid over the reach of the device
+const int SOLVE_GRID_X = 16;
+const int SOLVE_GRID_Y = 24;
+const int SOLVE_GRID_Z = 16;
+// longest simulated flight of a throw
+const double SOLVE_FLIGHT_TIME = 5.0;
+// nodes the search for the fewest throws visits before settling for the
+// greedy answer
+const long SOLVE_SEARCH_BUDGET = 2000000;
+
+/**
+ * A set of targets of one level, one bit per target.
+ */
+struct TargetSet {
+	static const int WORDS = MAX_TARGETS / 64;
+	unsigned long long bits[WORDS];
+
+	void clear();
+	void add(int);
+	bool has(int) const;
+	bool isEmpty() const;
+	bool contains(const TargetSet&) const;
+	void unite(const TargetSet&);
+	int countNew(const TargetSet&) const;
+};
+
+void TargetSet::clear() {
+	for (int w = 0; w < WORDS; w++) {
+		bits[w] = 0;
+	}
+}
+
+void TargetSet::add(int i) {
+	bits[i / 64] |= 1ULL << (i % 64);
+}
+
+bool TargetSet::has(int i) const {
+	return (bits[i / 64] >> (i % 64)) & 1;
+}
+
+bool TargetSet::isEmpty() const {
+	for (int w = 0; w < WORDS; w++) {
+		if (bits[w] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool TargetSet::contains(const TargetSet& other) const {
+	for (int w = 0; w < WORDS; w++) {
+		if ((other.bits[w] & ~bits[w]) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void TargetSet::unite(const TargetSet& other) {
+	for (int w = 0; w < WORDS; w++) {
+		bits[w] |= other.bits[w];
+	}
+}
+
+/**
+ * Number of bits set in a word.
+ */
+inline int countBits(unsigned long long word) {
+#if defined(_MSC_VER) && defined(_M_X64)
+	return (int) __popcnt64(word);
+#elif defined(_MSC_VER)
+	return (int) (__popcnt((unsigned int) word) + __popcnt(
+			(unsigned int) (word >> 32)));
+#else
+	return __builtin_popcountll(word);
+#endif
+}
+
+/**
+ * How many targets of other are not in this set.
+ */
+int TargetSet::countNew(const TargetSet& other) const {
+	int n = 0;
+	for (int w = 0; w < WORDS; w++) {
+		n += countBits(other.bits[w] & ~bits[w]);
+	}
+	return n;
+}
+
+/**
+ * Runs a fixed batch of tasks on a set of threads. Every thread has its own
+ * queue and works from its back; a thread whose queue is empty steals from
+ * the front of the others', so threads that drew short tasks help out the
+ * ones that drew long ones. No tasks are added while the pool runs, so a
+ * thread stops when every queue is empty.
+ */
+class WorkStealingPool {
+	struct Queue {
+		std::mutex lock;
+		std::deque<int> tasks;
+	};
+
+	std::vector<Queue*> queues;
+	int dealt;
+
+	bool take(int, int&);
+
+public:
+	WorkStealingPool(int);
+	~WorkStealingPool();
+	int getThreadCount();
+	void push(int);
+	template<class Task> void run(Task&);
+};
+
+WorkStealingPool::WorkStealingPool(int threads) {
+	dealt = 0;
+	for (int i = 0; i < threads; i++) {
+		queues.push_back(new Queue());
+	}
+}
+
+WorkStealingPool::~WorkStealingPool() {
+	for (size_t i = 0; i < queues.size(); i++) {
+		delete queues[i];
+	}
+}
+
+int WorkStealingPool::getThreadCount() {
+	return (int) queues.size();
+}
+
+/**
+ * Adds a task before the pool runs, the tasks are dealt out in turn.
+ */
+void WorkStealingPool::push(int task) {
+	queues[dealt++ % queues.size()]->tasks.push_back(task);
+}
+
+/**
+ * Takes the next task of thread t, stealing one if its own queue is empty.
+ */
+bool WorkStealingPool::take(int t, int& task) {
+	int n = (int) queues.size();
+	for (int k = 0; k < n; k++) {
+		Queue* queue = queues[(t + k) % n];
+		std::lock_guard<std::mutex> guard(queue->lock);
+		if (!queue->tasks.empty()) {
+			if (k == 0) {
+				task = queue->tasks.back();
+				queue->tasks.pop_back();
+			} else {
+				task = queue->tasks.front();
+				queue->tasks.pop_front();
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Calls work(thread, task) for every task and returns when all are done.
+ */
+template<class Task>
+void WorkStealingPool::run(Task& work) {
+	std::vector<std::thread> threads;
+	for (int t = 0; t < (int) queues.size(); t++) {
+		threads.push_back(std::thread([this, t, &work]() {
+			int task;
+			while (take(t, task)) {
+				work(t, task);
+			}
+		}));
+	}
+	for (size_t t = 0; t < threads.size(); t++) {
+		threads[t].join();
+	}
+}
+
+/**
+ * The pull-backs of the solver grid and what each of them hits in every
+ * level. A task of the solver throws from one column of the grid (all
+ * heights of one x, y) in one level.
+ */
+class LevelSolver {
+	struct Worker {
+		TargetPool targets;
+		ProjectilePool projectiles;
+	};
+
+	int levelCount;
+	std::vector<cVector3d> pullBacks;
+	// pull-backs within reach, per column
+	std::vector<int> columnStart;
+	std::vector<TargetSet> hits;
+	std::vector<Worker*> workers;
+
+	void throwAt(Worker&, int, int);
+	int findFewestThrows(int, std::vector<int>&, bool&);
+	bool cover(const TargetSet*, const std::vector<int>&, const TargetSet&,
+			int, int, std::vector<int>&, long&);
+
+public:
+	LevelSolver();
+	~LevelSolver();
+	void operator()(int, int);
+	double solve(int);
+	void report(double, int);
+	bool writeTable(const char*);
+};
+
+/**
+ * Lays out the grid over the pull-backs the device can reach: a ball of
+ * the cursor workspace radius around the resting device, above the ground.
+ */
+LevelSolver::LevelSolver() {
+	levelCount = levelPack->getLevelCount();
+	cVector3d rest = cNegate(deviceCenter);
+	double reach = cursorWorkspaceRadius;
+	for (int i = 0; i < SOLVE_GRID_X; i++) {
+		for (int j = 0; j < SOLVE_GRID_Y; j++) {
+			columnStart.push_back((int) pullBacks.size());
+			for (int k = 0; k < SOLVE_GRID_Z; k++) {
+				cVector3d offset(reach * (2.0 * (i + 0.5) / SOLVE_GRID_X - 1),
+						reach * (2.0 * (j + 0.5) / SOLVE_GRID_Y - 1), reach
+								* (2.0 * (k + 0.5) / SOLVE_GRID_Z - 1));
+				cVector3d pullBack = cAdd(rest, offset);
+				if (offset.length() <= reach && pullBack.z >= groundZ) {
+					pullBacks.push_back(pullBack);
+				}
+			}
+		}
+	}
+	columnStart.push_back((int) pullBacks.size());
+	hits.resize(levelCount * pullBacks.size());
+}
+
+LevelSolver::~LevelSolver() {
+	for (size_t i = 0; i < workers.size(); i++) {
+		delete workers[i];
+	}
+}
+
+/**
+ * Releases the projectile at pull-back p in level lvl and stores the
+ * targets it touches, running the same steps as stepPhysics().
+ */
+void LevelSolver::throwAt(Worker& worker, int lvl, int p) {
+	const LevelDef& def = levelPack->getLevel(lvl);
+	TargetPool& targets = worker.targets;
+	ProjectilePool& projectiles = worker.projectiles;
+	targets.reset(&levelPack->getTarget(def.firstTarget), def);
+	projectiles.clear();
+	projectiles.hold(pullBacks[p], projectileRadius);
+	int thrown = projectiles.release();
+
+	// beyond this the projectile cannot reach a target any more
+	double farthest = def.boundsMin.x;
+	for (int i = 0; i < targets.count; i++) {
+		if (targets.x[i] - targets.radius[i] < farthest) {
+			farthest = targets.x[i] - targets.radius[i];
+		}
+	}
+	farthest -= projectileRadius;
+
+	double dt = physicsTimeStep;
+	for (double t = 0; t < SOLVE_FLIGHT_TIME; t += dt) {
+		projectiles.move(dt);
+		projectiles.collide(targets, dt);
+		targets.move(dt);
+		if (projectiles.state[thrown] == PROJECTILE_RESTING
+				|| targets.allHit() || (projectiles.x[thrown] < farthest
+				&& projectiles.vx[thrown] <= 0)) {
+			break;
+		}
+	}
+
+	TargetSet& hit = hits[lvl * pullBacks.size() + p];
+	hit.clear();
+	for (int i = 0; i < targets.count; i++) {
+		if (targets.collided[i]) {
+			hit.add(i);
+		}
+	}
+}
+
+/**
+ * Task of the thread pool: throws from every pull-back of one column in
+ * one level.
+ */
+void LevelSolver::operator()(int thread, int task) {
+	Worker& worker = *workers[thread];
+	int columns = (int) columnStart.size() - 1;
+	int lvl = task / columns;
+	int column = task % columns;
+	for (int p = columnStart[column]; p < columnStart[column + 1]; p++) {
+		throwAt(worker, lvl, p);
+	}
+}
+
+/**
+ * Throws from the whole grid in every level on the given number of
+ * threads. Returns the time it took in seconds.
+ */
+double LevelSolver::solve(int threads) {
+	// every thread simulates its throws in pools of its own
+	for (int t = 0; t < threads; t++) {
+		Worker* worker = new Worker();
+		worker->projectiles.setRecording(false);
+		workers.push_back(worker);
+	}
+	WorkStealingPool pool(threads);
+	int columns = (int) columnStart.size() - 1;
+	for (int task = 0; task < levelCount * columns; task++) {
+		pool.push(task);
+	}
+
+	long long start = nowNs();
+	pool.run(*this);
+	return (nowNs() - start) * 1e-9;
+}
+
+/**
+ * Finds the fewest pull-backs that together hit every target of level lvl,
+ * all of which must be hit by some pull-back. Searches for fewer throws
+ * than the greedy answer until the search budget runs out; exact is false
+ * if it did.
+ */
+int LevelSolver::findFewestThrows(int lvl, std::vector<int>& chosen,
+		bool& exact) {
+	const TargetSet* levelHits = &hits[lvl * pullBacks.size()];
+
+	// only keep the pull-backs no other one does better than
+	std::vector<int> useful;
+	for (int p = 0; p < (int) pullBacks.size(); p++) {
+		if (levelHits[p].isEmpty()) {
+			continue;
+		}
+		bool dominated = false;
+		for (size_t u = 0; u < useful.size() && !dominated; u++) {
+			dominated = levelHits[useful[u]].contains(levelHits[p]);
+		}
+		if (dominated) {
+			continue;
+		}
+		size_t kept = 0;
+		for (size_t u = 0; u < useful.size(); u++) {
+			if (!levelHits[p].contains(levelHits[useful[u]])) {
+				useful[kept++] = useful[u];
+			}
+		}
+		useful.resize(kept);
+		useful.push_back(p);
+	}
+
+	// greedy: take the pull-back hitting the most targets not hit yet
+	int count = levelPack->getLevel(lvl).targetCount;
+	TargetSet covered;
+	covered.clear();
+	chosen.clear();
+	int coveredCount = 0;
+	while (coveredCount < count) {
+		int best = -1;
+		int bestNew = 0;
+		for (size_t u = 0; u < useful.size(); u++) {
+			int n = covered.countNew(levelHits[useful[u]]);
+			if (n > bestNew) {
+				best = useful[u];
+				bestNew = n;
+			}
+		}
+		covered.unite(levelHits[best]);
+		coveredCount += bestNew;
+		chosen.push_back(best);
+	}
+
+	// then look for a cover with fewer throws
+	exact = true;
+	long budget = SOLVE_SEARCH_BUDGET;
+	for (int throws = 1; throws < (int) chosen.size(); throws++) {
+		std::vector<int> better;
+		covered.clear();
+		if (cover(levelHits, useful, covered, count, throws, better, budget)) {
+			chosen = better;
+			break;
+		}
+		if (budget <= 0) {
+			exact = false;
+			break;
+		}
+	}
+	return (int) chosen.size();
+}
+
+/**
+ * Depth-first search for at most throws more pull-backs that hit the
+ * targets not in covered. The first target not hit yet has to be hit by
+ * one of them, so only the pull-backs hitting it are tried.
+ */
+bool LevelSolver::cover(const TargetSet* levelHits,
+		const std::vector<int>& useful, const TargetSet& covered, int count,
+		int throws, std::vector<int>& chosen, long& budget) {
+	int first = 0;
+	while (first < count && covered.has(first)) {
+		first++;
+	}
+	if (first == count) {
+		return true;
+	}
+	if (throws == 0 || --budget <= 0) {
+		return false;
+	}
+
+	for (size_t u = 0; u < useful.size(); u++) {
+		const TargetSet& hit = levelHits[useful[u]];
+		if (!hit.has(first)) {
+			continue;
+		}
+		TargetSet next = covered;
+		next.unite(hit);
+		chosen.push_back(useful[u]);
+		if (cover(levelHits, useful, next, count, throws - 1, chosen, budget)) {
+			return true;
+		}
+		chosen.pop_back();
+		if (budget <= 0) {
+			return false;
+		}
+	}
+	return false;
+}
+
+/**
+ * Prints for every level which targets can be hit, from where, and the
+ * fewest throws that clear it.
+ */
+void LevelSolver::report(double seconds, int threads) {
+	size_t throws = 0;
+	for (int lvl = 0; lvl < levelCount; lvl++) {
+		const LevelDef& def = levelPack->getLevel(lvl);
+		const TargetSet* levelHits = &hits[lvl * pullBacks.size()];
+		printf("level %d: %d targets\n", lvl, def.targetCount);
+
+		bool solvable = true;
+		for (int i = 0; i < def.targetCount; i++) {
+			const TargetDef& target = levelPack->getTarget(def.firstTarget + i);
+			int from = 0;
+			cVector3d low(1e9, 1e9, 1e9);
+			cVector3d high(-1e9, -1e9, -1e9);
+			for (size_t p = 0; p < pullBacks.size(); p++) {
+				if (levelHits[p].has(i)) {
+					const cVector3d& pullBack = pullBacks[p];
+					from++;
+					low.set(cMin(low.x, pullBack.x), cMin(low.y, pullBack.y),
+							cMin(low.z, pullBack.z));
+					high.set(cMax(high.x, pullBack.x), cMax(high.y,
+							pullBack.y), cMax(high.z, pullBack.z));
+				}
+			}
+			printf("  target %d at (%.2f %.2f %.2f): ", i, target.pos.x,
+					target.pos.y, target.pos.z);
+			if (from == 0) {
+				printf("never hit\n");
+				solvable = false;
+			} else {
+				printf("hit from %d of %d pull-backs, x %.2f to %.2f, "
+					"y %.2f to %.2f, z %.2f to %.2f\n", from,
+						(int) pullBacks.size(), low.x, high.x, low.y, high.y,
+						low.z, high.z);
+			}
+		}
+
+		if (!solvable) {
+			printf("  cannot be cleared\n");
+		} else if (def.targetCount > 0) {
+			std::vector<int> chosen;
+			bool exact;
+			int fewest = findFewestThrows(lvl, chosen, exact);
+			printf("  %s %d throws:", exact ? "fewest" : "at most", fewest);
+			for (size_t c = 0; c < chosen.size(); c++) {
+				const cVector3d& pullBack = pullBacks[chosen[c]];
+				printf(" (%.2f %.2f %.2f)", pullBack.x, pullBack.y, pullBack.z);
+			}
+			printf("\n");
+		}
+		throws += pullBacks.size();
+	}
+	printf("%d levels, %d throws in %.2f s on %d threads, %.0f throws/s\n",
+			levelCount, (int) throws, seconds, threads, throws / seconds);
+}
+
+/**
+ * Writes every pull-back of every level and the targets it hits as CSV.
+ */
+bool LevelSolver::writeTable(const char* fileName) {
+	FILE* file = fopen(fileName, "w");
+	if (file == NULL) {
+		return false;
+	}
+	fprintf(file, "level,x,y,z,targets\n");
+	for (int lvl = 0; lvl < levelCount; lvl++) {
+		int count = levelPack->getLevel(lvl).targetCount;
+		for (size_t p = 0; p < pullBacks.size(); p++) {
+			const TargetSet& hit = hits[lvl * pullBacks.size() + p];
+			fprintf(file, "%d,%f,%f,%f,", lvl, pullBacks[p].x, pullBacks[p].y,
+					pullBacks[p].z);
+			const char* separator = "";
+			for (int i = 0; i < count; i++) {
+				if (hit.has(i)) {
+					fprintf(file, "%s%d", separator, i);
+					separator = " ";
+				}
+			}
+			fprintf(file, "\n");
+		}
+	}
+	fclose(file);
+	return true;
+}
+
+/**
+ * Solves every level of the level pack on the given number of threads (0
+ * for one per core) and writes the pull-back table if tableFile is set.
+ */
+int solveLevels(int threads, const char* tableFile) {
+	if (threads <= 0) {
+		threads = (int) std::thread::hardware_concurrency();
+		if (threads <= 0) {
+			threads = 1;
+		}
+	}
+	LevelSolver solver;
+	double seconds = solver.solve(threads);
+	solver.report(seconds, threads);
+	if (tableFile != NULL && !solver.writeTable(tableFile)) {
+		printf("could not write %s\n", tableFile);
+		return (1);
+	}
+	return (0);
+}
+
+//////////////////////////////////////////
+// Level generator
+//////////////////////////////////////////
+// The generator (--generate, --endless) makes up target layouts and keeps
+// the ones that are as hard as asked for. How hard a target is comes from a
+// bank of throws from random pull-backs, flown once with the projectile
+// pool of the game: the chance of hitting it is the share of the bank that
+// touches it before any other target. The throws are the same for every
+// layout, so trying a layout only costs sweeping the recorded paths.
+
+// throws in the bank and the physics steps between two recorded points
+const int BANK_THROWS = 1024;
+const int BANK_RECORD_STEPS = 5;
+// recorded segments per bounding box of a path
+const int BANK_CHUNK = 16;
+// the throws are spread over this many points in time after the level
+// starts, so that moving targets are met in different places
+const int BANK_THROW_TIMES = 8;
+const double BANK_THROW_INTERVAL = 0.5;
+
+// where generated targets are put
+const double GENERATE_MIN_X = -14;
+const double GENERATE_MAX_X = -2;
+const double GENERATE_MIN_Z = -0.6;
+const double GENERATE_MAX_Z = 1.2;
+// layouts tried for one level before giving up on it
+const int GENERATE_ATTEMPTS = 400;
+// levels in one pack of endless play
+const int ENDLESS_LEVELS = 10;
+
+enum Difficulty {
+	DIFFICULTY_EASY, DIFFICULTY_MEDIUM, DIFFICULTY_HARD, DIFFICULTY_COUNT
+};
+
+const char* DIFFICULTY_NAMES[DIFFICULTY_COUNT] = { "easy", "medium", "hard" };
+
+/**
+ * What the levels of a difficulty look like: how many targets they have,
+ * how often a target moves or lies on the ground, and the range the chance
+ * of hitting their hardest target has to be in.
+ */
+struct DifficultyDef {
+	int minTargets;
+	int maxTargets;
+	double movingShare;
+	double groundShare;
+	double minChance;
+	double maxChance;
+};
+
+const DifficultyDef DIFFICULTIES[DIFFICULTY_COUNT] = {
+		{ 1, 3, 0, 0.2, 0.02, 1 },
+		{ 2, 4, 0.2, 0.2, 0.008, 0.02 },
+		{ 3, 5, 0.35, 0.25, 0.002, 0.008 } };
+
+/**
+ * The recorded paths of the bank throws. The points of throw k are
+ * pathStart[k] to pathStart[k + 1] - 1, BANK_RECORD_STEPS physics steps
+ * apart, and every BANK_CHUNK segments of a path have a bounding box.
+ */
+class FlightBank {
+	std::vector<double> pathX;
+	std::vector<double> pathY;
+	std::vector<double> pathZ;
+	std::vector<int> pathStart;
+	std::vector<cVector3d> chunkMin;
+	std::vector<cVector3d> chunkMax;
+	std::vector<int> chunkStart;
+
+	void addBox(int, int);
+
+public:
+	// points from the start of the level to the last throw time
+	int throwIntervalPoints;
+	int longestPath;
+
+	FlightBank();
+	void fly(unsigned long long);
+	void measure(const double*, const double*, const double*, const double*,
+			const double*, int, bool, int*);
+};
+
+FlightBank::FlightBank() {
+	throwIntervalPoints = 0;
+	longestPath = 0;
+}
+
+/**
+ * Throws BANK_THROWS projectiles from random pull-backs within reach of the
+ * device, a pool full at a time, and records their paths until they rest
+ * or have flown past the generated targets.
+ */
+void FlightBank::fly(unsigned long long seed) {
+	FastRandom random(seed);
+	double dt = physicsTimeStep;
+	throwIntervalPoints = (int) (BANK_THROW_INTERVAL / (BANK_RECORD_STEPS
+			* dt) + 0.5);
+	cVector3d rest = cNegate(deviceCenter);
+	double reach = cursorWorkspaceRadius;
+	ProjectilePool* pool = new ProjectilePool();
+	pool->setRecording(false);
+	std::vector<double> paths[MAX_PROJECTILES];
+
+	pathStart.push_back(0);
+	chunkStart.push_back(0);
+	for (int first = 0; first < BANK_THROWS; first += MAX_PROJECTILES) {
+		pool->clear();
+		for (int j = 0; j < MAX_PROJECTILES; j++) {
+			cVector3d offset;
+			do {
+				offset.set(reach * (2 * random.uniform() - 1), reach * (2
+						* random.uniform() - 1), reach * (2 * random.uniform()
+						- 1));
+			} while (offset.length() > reach || rest.z + offset.z < groundZ);
+			pool->hold(cAdd(rest, offset), projectileRadius);
+			pool->release();
+			paths[j].clear();
+		}
+
+		bool flying = true;
+		for (int step = 0; flying && step * dt < SOLVE_FLIGHT_TIME; step++) {
+			if (step % BANK_RECORD_STEPS == 0) {
+				flying = false;
+				for (int j = 0; j < MAX_PROJECTILES; j++) {
+					bool gone = pool->x[j] < GENERATE_MIN_X - 2 && pool->vx[j]
+							<= 0;
+					if (pool->state[j] == PROJECTILE_RESTING || (gone
+							&& !paths[j].empty())) {
+						continue;
+					}
+					paths[j].push_back(pool->x[j]);
+					paths[j].push_back(pool->y[j]);
+					paths[j].push_back(pool->z[j]);
+					flying = true;
+				}
+			}
+			pool->move(dt);
+		}
+
+		for (int j = 0; j < MAX_PROJECTILES; j++) {
+			int start = (int) pathX.size();
+			for (size_t p = 0; p < paths[j].size(); p += 3) {
+				pathX.push_back(paths[j][p]);
+				pathY.push_back(paths[j][p + 1]);
+				pathZ.push_back(paths[j][p + 2]);
+			}
+			int end = (int) pathX.size();
+			pathStart.push_back(end);
+			for (int c = start; c < end - 1; c += BANK_CHUNK) {
+				addBox(c, c + BANK_CHUNK < end - 1 ? c + BANK_CHUNK : end - 1);
+			}
+			chunkStart.push_back((int) chunkMin.size());
+			if (end - start > longestPath) {
+				longestPath = end - start;
+			}
+		}
+	}
+	delete pool;
+}
+
+/**
+ * Adds the bounding box of the points first to last.
+ */
+void FlightBank::addBox(int first, int last) {
+	cVector3d low(pathX[first], pathY[first], pathZ[first]);
+	cVector3d high = low;
+	for (int p = first + 1; p <= last; p++) {
+		low.set(cMin(low.x, pathX[p]), cMin(low.y, pathY[p]), cMin(low.z,
+				pathZ[p]));
+		high.set(cMax(high.x, pathX[p]), cMax(high.y, pathY[p]), cMax(high.z,
+				pathZ[p]));
+	}
+	chunkMin.push_back(low);
+	chunkMax.push_back(high);
+}
+
+/**
+ * Counts for each of count targets how many bank throws touch it first.
+ * The target centers at recorded point t after the start of the level are
+ * x[t * count + i] etc; if no target moves there only is t = 0.
+ */
+void FlightBank::measure(const double* x, const double* y, const double* z,
+		const double* radius, const double* speed, int count, bool moving,
+		int* hits) {
+	double chunkTime = BANK_CHUNK * BANK_RECORD_STEPS * physicsTimeStep;
+	double times[MAX_TARGETS];
+	for (int i = 0; i < count; i++) {
+		hits[i] = 0;
+	}
+	for (int k = 0; k < BANK_THROWS; k++) {
+		int offset = moving ? (k % BANK_THROW_TIMES) * throwIntervalPoints : 0;
+		int first = -1;
+		for (int c = chunkStart[k]; c < chunkStart[k + 1] && first == -1; c++) {
+			int p0 = pathStart[k] + (c - chunkStart[k]) * BANK_CHUNK;
+
+			// skip the boxes no target comes near while the throw passes
+			int t0 = moving ? (offset + p0 - pathStart[k]) * count : 0;
+			bool near = false;
+			for (int i = 0; i < count && !near; i++) {
+				double reach = radius[i] + projectileRadius + speed[i]
+						* chunkTime;
+				int j = t0 + i;
+				near = x[j] > chunkMin[c].x - reach && x[j] < chunkMax[c].x
+						+ reach && y[j] > chunkMin[c].y - reach && y[j]
+						< chunkMax[c].y + reach && z[j] > chunkMin[c].z - reach
+						&& z[j] < chunkMax[c].z + reach;
+			}
+			if (!near) {
+				continue;
+			}
+
+			int p1 = p0 + BANK_CHUNK < pathStart[k + 1] - 1 ? p0 + BANK_CHUNK
+					: pathStart[k + 1] - 1;
+			for (int p = p0; p < p1 && first == -1; p++) {
+				cVector3d from(pathX[p], pathY[p], pathZ[p]);
+				cVector3d move(pathX[p + 1] - from.x, pathY[p + 1] - from.y,
+						pathZ[p + 1] - from.z);
+				int t = moving ? (offset + p - pathStart[k]) * count : 0;
+				sweepSpheres(x + t, y + t, z + t, radius, count, from, move,
+						projectileRadius, times);
+				double toi = 2;
+				for (int i = 0; i < count; i++) {
+					if (times[i] < toi) {
+						first = i;
+						toi = times[i];
+					}
+				}
+			}
+		}
+		if (first != -1) {
+			hits[first]++;
+		}
+	}
+}
+
+// the bank of the generator, flown once
+FlightBank* flightBank = NULL;
+
+/**
+ * Makes up levels of one difficulty. Level i is made from a random
+ * generator seeded with the seed and i, so a pack comes out the same for
+ * the same seed on any number of threads.
+ */
+class LevelGenerator {
+	struct Worker {
+		TargetPool targets;
+		std::vector<double> trackX;
+		std::vector<double> trackY;
+		std::vector<double> trackZ;
+	};
+
+	const DifficultyDef& difficulty;
+	unsigned long long seed;
+	std::vector<Worker*> workers;
+	std::vector<string> levels;
+	std::atomic<int> attempts;
+
+	void makeLayout(FastRandom&, LevelDef&, TargetDef*);
+	bool measure(Worker&, const LevelDef&, const TargetDef*, double*);
+
+public:
+	LevelGenerator(Difficulty, unsigned long long);
+	~LevelGenerator();
+	void operator()(int, int);
+	int generate(int, int);
+	string getPack();
+	int getAttempts();
+};
+
+LevelGenerator::LevelGenerator(Difficulty d, unsigned long long s) :
+	difficulty(DIFFICULTIES[d]), seed(s), attempts(0) {
+	if (flightBank == NULL) {
+		flightBank = new FlightBank();
+		flightBank->fly(0x5eedba4cULL);
+	}
+}
+
+LevelGenerator::~LevelGenerator() {
+	for (size_t i = 0; i < workers.size(); i++) {
+		delete workers[i];
+	}
+}
+
+/**
+ * Places the targets of a random layout. Targets stand in the air, lie on
+ * the ground or move, and keep some room between them.
+ */
+void LevelGenerator::makeLayout(FastRandom& random, LevelDef& level,
+		TargetDef* defs) {
+	level.firstTarget = 0;
+	level.targetCount = difficulty.minTargets + (int) (random.uniform()
+			* (difficulty.maxTargets - difficulty.minTargets + 1));
+	level.boundsMin.set(GENERATE_MIN_X - 1, -3, groundZ);
+	level.boundsMax.set(GENERATE_MAX_X + 1, 3, GENERATE_MAX_Z + 0.5);
+	for (int i = 0; i < level.targetCount; i++) {
+		TargetDef& def = defs[i];
+		def.radius = TARGET_RADIUS;
+		def.axis.set(0, 1, 0);
+		def.angle = 0;
+		def.vel.zero();
+		bool apart;
+		do {
+			double x = GENERATE_MIN_X + random.uniform() * (GENERATE_MAX_X
+					- GENERATE_MIN_X);
+			// the farther away, the wider the throws spread
+			double width = 0.5 + 0.15 * -x;
+			def.pos.set(x, width * (2 * random.uniform() - 1), GENERATE_MIN_Z
+					+ random.uniform() * (GENERATE_MAX_Z - GENERATE_MIN_Z));
+			apart = true;
+			for (int j = 0; j < i && apart; j++) {
+				apart = cSub(def.pos, defs[j].pos).length() > 3 * TARGET_RADIUS;
+			}
+		} while (!apart);
+
+		double kind = random.uniform();
+		if (kind < difficulty.movingShare) {
+			def.vel.set(0, 2 * random.uniform() - 1, random.uniform() - 0.5);
+		} else if (kind < difficulty.movingShare + difficulty.groundShare) {
+			def.pos.z = groundZ;
+			def.angle = -M_PI / 2;
+		}
+	}
+}
+
+/**
+ * Finds the chance of hitting each target of a layout with a bank throw.
+ * Returns whether the hardest one is in the range of the difficulty.
+ */
+bool LevelGenerator::measure(Worker& worker, const LevelDef& level,
+		const TargetDef* defs, double* chances) {
+	TargetPool& targets = worker.targets;
+	targets.reset(defs, level);
+	int count = targets.count;
+	bool moving = false;
+	for (int i = 0; i < count; i++) {
+		moving = moving || targets.moving[i];
+	}
+
+	// where the targets are at every recorded point of the throws
+	int points = moving ? flightBank->longestPath + (BANK_THROW_TIMES - 1)
+			* flightBank->throwIntervalPoints : 1;
+	worker.trackX.resize(points * count);
+	worker.trackY.resize(points * count);
+	worker.trackZ.resize(points * count);
+	for (int t = 0; t < points; t++) {
+		for (int i = 0; i < count; i++) {
+			worker.trackX[t * count + i] = targets.x[i];
+			worker.trackY[t * count + i] = targets.y[i];
+			worker.trackZ[t * count + i] = targets.z[i];
+		}
+		if (moving) {
+			for (int s = 0; s < BANK_RECORD_STEPS; s++) {
+				targets.move(physicsTimeStep);
+			}
+		}
+	}
+
+	int hits[MAX_TARGETS];
+	double speed[MAX_TARGETS] = { 0 };
+	for (int i = 0; i < count; i++) {
+		speed[i] = defs[i].vel.length();
+	}
+	flightBank->measure(&worker.trackX[0], &worker.trackY[0],
+			&worker.trackZ[0], targets.radius, speed, count, moving, hits);
+	double hardest = 1;
+	for (int i = 0; i < count; i++) {
+		chances[i] = (double) hits[i] / BANK_THROWS;
+		hardest = cMin(hardest, chances[i]);
+	}
+	return hardest >= difficulty.minChance && hardest <= difficulty.maxChance;
+}
+
+/**
+ * Task of the thread pool: tries layouts for level i until one fits.
+ */
+void LevelGenerator::operator()(int thread, int i) {
+	Worker& worker = *workers[thread];
+	FastRandom random(seed * 1000003 + i + 1);
+	LevelDef level;
+	TargetDef defs[MAX_TARGETS];
+	double chances[MAX_TARGETS];
+	for (int attempt = 0; attempt < GENERATE_ATTEMPTS; attempt++) {
+		attempts++;
+		makeLayout(random, level, defs);
+		if (!measure(worker, level, defs, chances)) {
+			continue;
+		}
+
+		std::ostringstream text;
+		text.setf(std::ios::fixed);
+		text.precision(2);
+		text << "# hit chances";
+		for (int t = 0; t < level.targetCount; t++) {
+			text << " " << chances[t] * 100 << "%";
+		}
+		text << "\nlevel bounds " << level.boundsMin.x << " "
+				<< level.boundsMin.y << " " << level.boundsMin.z << " "
+				<< level.boundsMax.x << " " << level.boundsMax.y << " "
+				<< level.boundsMax.z << "\n";
+		for (int t = 0; t < level.targetCount; t++) {
+			const TargetDef& def = defs[t];
+			text << "target " << def.pos.x << " " << def.pos.y << " "
+					<< def.pos.z;
+			if (def.angle != 0) {
+				text << " rot 0 1 0 -90";
+			}
+			if (def.vel.length() > 0) {
+				text << " vel " << def.vel.x << " " << def.vel.y << " "
+						<< def.vel.z;
+			}
+			text << "\n";
+		}
+		levels[i] = text.str();
+		return;
+	}
+}
+
+/**
+ * Makes count levels on the given number of threads. Returns how many
+ * could be made, a level gives up after GENERATE_ATTEMPTS layouts.
+ */
+int LevelGenerator::generate(int count, int threads) {
+	for (int t = (int) workers.size(); t < threads; t++) {
+		workers.push_back(new Worker());
+	}
+	levels.assign(count, string());
+	WorkStealingPool pool(threads);
+	for (int i = 0; i < count; i++) {
+		pool.push(i);
+	}
+	pool.run(*this);
+
+	int made = 0;
+	for (int i = 0; i < count; i++) {
+		made += levels[i].empty() ? 0 : 1;
+	}
+	return made;
+}
+
+/**
+ * The levels made as a level pack.
+ */
+string LevelGenerator::getPack() {
+	string pack = "# generated levels\n";
+	for (size_t i = 0; i < levels.size(); i++) {
+		if (!levels[i].empty()) {
+			pack += "\n" + levels[i];
+		}
+	}
+	return pack;
+}
+
+int LevelGenerator::getAttempts() {
+	return attempts;
+}
+
+/**
+ * Generates a level pack of count levels and writes it to fileName.
+ */
+int generateLevels(int count, const char* fileName, Difficulty difficulty,
+		unsigned long long seed, int threads) {
+	if (threads <= 0) {
+		threads = (int) std::thread::hardware_concurrency();
+		if (threads <= 0) {
+			threads = 1;
+		}
+	}
+	long long bankStart = nowNs();
+	LevelGenerator generator(difficulty, seed);
+	long long start = nowNs();
+	int made = generator.generate(count, threads);
+	double seconds = (nowNs() - start) * 1e-9;
+
+	FILE* file = fopen(fileName, "w");
+	if (file == NULL) {
+		printf("could not write %s\n", fileName);
+		return (1);
+	}
+	string pack = generator.getPack();
+	fwrite(pack.c_str(), 1, pack.size(), file);
+	fclose(file);
+	printf("%d of %d %s levels from %d layouts in %.2f s on %d threads, "
+		"%.0f levels/s (bank of %d throws flown in %.2f s)\n", made, count,
+			DIFFICULTY_NAMES[difficulty], generator.getAttempts(), seconds,
+			threads, made / seconds, BANK_THROWS, (start - bankStart) * 1e-9);
+	return (0);
+}
+
+/**
+ * A new pack of ENDLESS_LEVELS generated levels, or NULL if none could be
+ * made.
+ */
+LevelPack* generateLevelPack(Difficulty difficulty, unsigned long long seed,
+		int threads) {
+	LevelGenerator generator(difficulty, seed);
+	if (generator.generate(ENDLESS_LEVELS, threads) == 0) {
+		return NULL;
+	}
+	string text = generator.getPack();
+	LevelPack* pack = new LevelPack();
+	if (!pack->parse(text.c_str(), text.size(), "generated levels")) {
+		delete pack;
+		return NULL;
+	}
+	return pack;
+}
+
+// the difficulty and seed of generated levels, and the threads making the
+// packs of endless play
+Difficulty generateDifficulty = DIFFICULTY_MEDIUM;
+unsigned long long generateSeed = 1;
+int generatorThreads = 1;
+
+//////////////////////////////////////////
+// Scripted haptic device
+//////////////////////////////////////////
+/**
+ * A haptic device that plays back a script of positions and button states
+ * instead of reading hardware, for running the game without a Falcon.
+ *
+ * Each script line is "ticks x y z button": the device moves in a straight
+ * line to (x, y, z) (device coordinates, meters) over the given number of
+ * haptic ticks, with the user switch held if button is 1. A line "key c"
+ * presses key c on the keyboard (only 'n' does anything headless). Lines
+ * starting with # are comments.
+ */
+struct ScriptStep {
+	int ticks;
+	cVector3d pos;
+	bool button;
+	char key;
+};
+
+class ScriptedHapticDevice: public cGenericHapticDevice {
+private:
+	vector<ScriptStep> steps;
+	int step;
+	int tick;
+	char key;
+	cVector3d startPos;
+	cVector3d lastForce;
+public:
+	ScriptedHapticDevice();
+	bool loadScript(const char*);
+	void parseScript(const char*);
+	bool advance();
+	char takeKey();
+	cVector3d getLastForce();
+	virtual int open();
+	virtual int close();
+	virtual int initialize(const bool a_resetEncoders = false);
+	virtual int getPosition(cVector3d& a_position);
+	virtual int setForce(cVector3d& a_force);
+	virtual int getUserSwitch(int a_switchIndex, bool& a_status);
+	virtual ~ScriptedHapticDevice();
+};
+
+// a few throws at the first levels, used when no script file is given
+const char* DEFAULT_DEVICE_SCRIPT = "# skip the start screen\n"
+	"key n\n"
+	"# rest at the sling\n"
+	"500 -0.030 0.000 0.000 0\n"
+	"# pull back straight and let go\n"
+	"300 -0.030 0.000 0.000 1\n"
+	"600 0.020 0.000 -0.004 1\n"
+	"200 0.020 0.000 -0.004 1\n"
+	"3000 0.020 0.000 -0.004 0\n"
+	"# aim right\n"
+	"500 -0.030 0.000 0.000 0\n"
+	"600 0.020 0.019 -0.004 1\n"
+	"200 0.020 0.019 -0.004 1\n"
+	"3000 0.020 0.019 -0.004 0\n"
+	"# aim left\n"
+	"500 -0.030 0.000 0.000 0\n"
+	"600 0.020 -0.019 -0.004 1\n"
+	"200 0.020 -0.019 -0.004 1\n"
+	"3000 0.020 -0.019 -0.004 0\n";
+
+ScriptedHapticDevice::ScriptedHapticDevice() {
+	step = 0;
+	tick = 0;
+	key = 0;
+
+	// roughly a Novint Falcon
+	m_specifications.m_manufacturerName = "slingajinglebell";
+	m_specifications.m_modelName = "scripted device";
+	m_specifications.m_maxForce = 8.0;
+	m_specifications.m_workspaceRadius = 0.04;
+	m_specifications.m_sensedPosition = true;
+}
+
+/**
+ * Reads a script file, returns false if it could not be read.
+ */
+bool ScriptedHapticDevice::loadScript(const char* fileName) {
+	FILE* file = fopen(fileName, "r");
+	if (file == NULL) {
+		return false;
+	}
+	string script;
+	char buffer[4096];
+	size_t n;
+	while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+		script.append(buffer, n);
+	}
+	fclose(file);
+
+	parseScript(script.c_str());
+	return true;
+}
+
+void ScriptedHapticDevice::parseScript(const char* script) {
+	steps.clear();
+	step = 0;
+	tick = 0;
+	key = 0;
+
+	std::istringstream lines(script);
+	string line;
+	cVector3d lastPos;
+	while (std::getline(lines, line)) {
+		ScriptStep s;
+		int button;
+		char c;
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+		if (sscanf(line.c_str(), "key %c", &c) == 1) {
+			// stay where we are for one tick and press the key
+			s.ticks = 1;
+			s.pos = lastPos;
+			s.button = false;
+			s.key = c;
+			steps.push_back(s);
+		} else if (sscanf(line.c_str(), "%i %lf %lf %lf %i", &s.ticks,
+				&s.pos.x, &s.pos.y, &s.pos.z, &button) == 5 && s.ticks > 0) {
+			s.button = button != 0;
+			s.key = 0;
+			steps.push_back(s);
+			lastPos = s.pos;
+		}
+	}
+
+	startPos = lastPos;
+	for (unsigned int i = 0; i < steps.size(); i++) {
+		if (steps[i].key == 0) {
+			startPos = steps[i].pos;
+			break;
+		}
+	}
+}
+
+/**
+ * Moves on to the next haptic tick, returns false at the end of the script.
+ */
+bool ScriptedHapticDevice::advance() {
+	if (step >= (int) steps.size()) {
+		return false;
+	}
+	tick++;
+	if (tick > steps[step].ticks) {
+		startPos = steps[step].pos;
+		tick = 1;
+		step++;
+	}
+	if (step < (int) steps.size() && tick == 1) {
+		key = steps[step].key;
+	}
+	return step < (int) steps.size();
+}
+
+/**
+ * Returns the key pressed by the script since the last call, or 0.
+ */
+char ScriptedHapticDevice::takeKey() {
+	char pressed = key;
+	key = 0;
+	return pressed;
+}
+
+cVector3d ScriptedHapticDevice::getLastForce() {
+	return lastForce;
+}
+
+int ScriptedHapticDevice::open() {
+	m_systemReady = true;
+	return 0;
+}
+
+int ScriptedHapticDevice::close() {
+	m_systemReady = false;
+	return 0;
+}
+
+int ScriptedHapticDevice::initialize(const bool a_resetEncoders) {
+	return 0;
+}
+
+int ScriptedHapticDevice::getPosition(cVector3d& a_position) {
+	if (step >= (int) steps.size()) {
+		a_position = startPos;
+		return 0;
+	}
+	// move in a straight line towards the target of the current step
+	double t = (double) tick / steps[step].ticks;
+	a_position = cAdd(cMul(1 - t, startPos), cMul(t, steps[step].pos));
+	return 0;
+}
+
+int ScriptedHapticDevice::setForce(cVector3d& a_force) {
+	lastForce = a_force;
+	return 0;
+}
+
+int ScriptedHapticDevice::getUserSwitch(int a_switchIndex, bool& a_status) {
+	a_status = step < (int) steps.size() && steps[step].button;
+	return 0;
+}
+
+ScriptedHapticDevice::~ScriptedHapticDevice() {
+
+}
+
+// the device used in headless mode
+ScriptedHapticDevice* scriptedDevice = NULL;
+
+// simulated time step of the headless haptics loop
+const double HEADLESS_TIME_STEP = 0.001;
+
+//////////////////////////////////////////
+// Input trace
+//////////////////////////////////////////
+// A trace holds everything the haptics loop reads each tick, so that a
+// session can be replayed bit for bit. The file starts with TRACE_MAGIC,
+// TRACE_VERSION, the workspace radius and max force of the recorded device
+// (doubles), the physics sub-steps (int) and the hash of the level pack
+// (unsigned long long), followed by one record per tick: a byte of
+// TraceFlags, the raw device position (3 doubles) unless
+// TRACE_SAME_POSITION is set, and the time interval (double) unless
+// TRACE_SAME_INTERVAL is set. A trace only replays with the same sub-steps
+// and levels, and endless play is not recorded since its levels depend on
+// when the generator thread finishes.
+const char TRACE_MAGIC[4] = { 'S', 'J', 'B', 'T' };
+const unsigned char TRACE_VERSION = 2;
+const int TRACE_HEADER_SIZE = 4 + 1 + 2 * sizeof(double) + sizeof(int)
+		+ sizeof(unsigned long long);
+
+enum TraceFlags {
+	TRACE_USER_SWITCH = 1,
+	TRACE_LIMIT_X = 2,
+	TRACE_NEXT_LEVEL = 4,
+	TRACE_SAME_POSITION = 8,
+	TRACE_SAME_INTERVAL = 16
+};
+
+// room for about 15 minutes of ticks
+const size_t TRACE_CAPACITY = 32 * 1024 * 1024;
+
+/**
+ * Records the input of every haptic tick into memory allocated up front,
+ * the trace is written to disk by save() after the haptics loop has ended.
+ */
+class TraceRecorder {
+private:
+	vector<unsigned char> data;
+	cVector3d lastPos;
+	double lastInterval;
+	long ticks;
+	bool full;
+	void append(const void*, size_t);
+public:
+	TraceRecorder(const cHapticDeviceInfo&, int, unsigned long long);
+	void record(const cVector3d&, bool, double, bool, bool);
+	bool save(const char*);
+	long getTicks();
+	bool isFull();
+};
+
+TraceRecorder::TraceRecorder(const cHapticDeviceInfo& info, int subSteps,
+		unsigned long long packHash) {
+	data.reserve(TRACE_CAPACITY);
+	append(TRACE_MAGIC, 4);
+	append(&TRACE_VERSION, 1);
+	append(&info.m_workspaceRadius, sizeof(double));
+	append(&info.m_maxForce, sizeof(double));
+	append(&subSteps, sizeof(int));
+	append(&packHash, sizeof(unsigned long long));
+	lastInterval = -1;
+	ticks = 0;
+	full = false;
+}
+
+void TraceRecorder::append(const void* bytes, size_t size) {
+	const unsigned char* b = (const unsigned char*) bytes;
+	data.insert(data.end(), b, b + size);
+}
+
+/**
+ * Adds one tick to the trace. Never allocates; when the buffer is full
+ * the recording stops.
+ */
+void TraceRecorder::record(const cVector3d& devicePos, bool userSwitch,
+		double timeInterval, bool limitX, bool nextLevel) {
+	if (full || data.size() + 1 + 4 * sizeof(double) > TRACE_CAPACITY) {
+		full = true;
+		return;
+	}
+
+	unsigned char flags = 0;
+	if (userSwitch) {
+		flags |= TRACE_USER_SWITCH;
+	}
+	if (limitX) {
+		flags |= TRACE_LIMIT_X;
+	}
+	if (nextLevel) {
+		flags |= TRACE_NEXT_LEVEL;
+	}
+	bool samePos = ticks > 0 && devicePos.x == lastPos.x && devicePos.y
+			== lastPos.y && devicePos.z == lastPos.z;
+	if (samePos) {
+		flags |= TRACE_SAME_POSITION;
+	}
+	if (timeInterval == lastInterval) {
+		flags |= TRACE_SAME_INTERVAL;
+	}
+
+	append(&flags, 1);
+	if (!samePos) {
+		append(&devicePos.x, sizeof(double));
+		append(&devicePos.y, sizeof(double));
+		append(&devicePos.z, sizeof(double));
+	}
+	if (timeInterval != lastInterval) {
+		append(&timeInterval, sizeof(double));
+	}
+
+	lastPos = devicePos;
+	lastInterval = timeInterval;
+	ticks++;
+}
+
+bool TraceRecorder::save(const char* fileName) {
+	FILE* file = fopen(fileName, "wb");
+	if (file == NULL) {
+		return false;
+	}
+	bool ok = fwrite(&data[0], 1, data.size(), file) == data.size();
+	fclose(file);
+	return ok;
+}
+
+long TraceRecorder::getTicks() {
+	return ticks;
+}
+
+bool TraceRecorder::isFull() {
+	return full;
+}
+
+/**
+ * A haptic device that plays back a recorded trace.
+ */
+class TraceReplayDevice: public cGenericHapticDevice {
+private:
+	vector<unsigned char> data;
+	size_t offset;
+	cVector3d pos;
+	bool userSwitch;
+	double interval;
+	long ticks;
+	int subSteps;
+	unsigned long long packHash;
+	bool read(void*, size_t);
+public:
+	TraceReplayDevice();
+	bool load(const char*);
+	bool advance(double&, unsigned char&);
+	long getTicks();
+	int getSubSteps();
+	unsigned long long getPackHash();
+	virtual int open();
+	virtual int close();
+	virtual int initialize(const bool a_resetEncoders = false);
+	virtual int getPosition(cVector3d& a_position);
+	virtual int setForce(cVector3d& a_force);
+	virtual int getUserSwitch(int a_switchIndex, bool& a_status);
+	virtual ~TraceReplayDevice();
+};
+
+TraceReplayDevice::TraceReplayDevice() {
+	offset = 0;
+	userSwitch = false;
+	interval = 0;
+	ticks = 0;
+	subSteps = 1;
+	packHash = 0;
+}
+
+bool TraceReplayDevice::read(void* bytes, size_t size) {
+	if (offset + size > data.size()) {
+		return false;
+	}
+	memcpy(bytes, &data[offset], size);
+	offset += size;
+	return true;
+}
+
+/**
+ * Reads a trace file, returns false if it is missing or not a trace.
+ */
+bool TraceReplayDevice::load(const char* fileName) {
+	FILE* file = fopen(fileName, "rb");
+	if (file == NULL) {
+		return false;
+	}
+	unsigned char buffer[4096];
+	size_t n;
+	data.clear();
+	while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+		data.insert(data.end(), buffer, buffer + n);
+	}
+	fclose(file);
+
+	char magic[4];
+	unsigned char version;
+	offset = 0;
+	if (!read(magic, 4) || memcmp(magic, TRACE_MAGIC, 4) != 0 || !read(
+			&version, 1) || version != TRACE_VERSION) {
+		return false;
+	}
+
+	// replay with the workspace and forces of the recorded device
+	return read(&m_specifications.m_workspaceRadius, sizeof(double)) && read(
+			&m_specifications.m_maxForce, sizeof(double)) && read(&subSteps,
+			sizeof(int)) && read(&packHash, sizeof(unsigned long long));
+}
+
+/**
+ * Moves on to the next recorded tick, returns false at the end of the trace.
+ */
+bool TraceReplayDevice::advance(double& timeInterval, unsigned char& flags) {
+	if (!read(&flags, 1)) {
+		return false;
+	}
+	if (!(flags & TRACE_SAME_POSITION)) {
+		if (!read(&pos.x, sizeof(double)) || !read(&pos.y, sizeof(double))
+				|| !read(&pos.z, sizeof(double))) {
+			return false;
+		}
+	}
+	if (!(flags & TRACE_SAME_INTERVAL)) {
+		if (!read(&interval, sizeof(double))) {
+			return false;
+		}
+	}
+	userSwitch = (flags & TRACE_USER_SWITCH) != 0;
+	timeInterval = interval;
+	ticks++;
+	return true;
+}
+
+long TraceReplayDevice::getTicks() {
+	return ticks;
+}
+
+/**
+ * The physics sub-steps the trace was recorded with.
+ */
+int TraceReplayDevice::getSubSteps() {
+	return subSteps;
+}
+
+/**
+ * The hash of the level pack the trace was recorded with.
+ */
+unsigned long long TraceReplayDevice::getPackHash() {
+	return packHash;
+}
+
+int TraceReplayDevice::open() {
+	m_systemReady = true;
+	return 0;
+}
+
+int TraceReplayDevice::close() {
+	m_systemReady = false;
+	return 0;
+}
+
+int TraceReplayDevice::initialize(const bool a_resetEncoders) {
+	return 0;
+}
+
+int TraceReplayDevice::getPosition(cVector3d& a_position) {
+	a_position = pos;
+	return 0;
+}
+
+int TraceReplayDevice::setForce(cVector3d& a_force) {
+	return 0;
+}
+
+int TraceReplayDevice::getUserSwitch(int a_switchIndex, bool& a_status) {
+	a_status = userSwitch;
+	return 0;
+}
+
+TraceReplayDevice::~TraceReplayDevice() {
+
+}
+
+// recording and replaying of the device input
+TraceRecorder* traceRecorder = NULL;
+const char* traceFile = NULL;
+TraceReplayDevice* replayDevice = NULL;
+
+// running FNV-1a hash of the simulated state, equal for a recording and
+// its replay
+unsigned long long simulationHash = 14695981039346656037ULL;
+
+void hashState(const void* bytes, size_t size) {
+	const unsigned char* b = (const unsigned char*) bytes;
+	for (size_t i = 0; i < size; i++) {
+		simulationHash = (simulationHash ^ b[i]) * 1099511628211ULL;
+	}
+}
+
+// projectile spheres and their shadows
+cShapeSphere* projectileSpheres[MAX_PROJECTILES];
+CircleMesh* projectileShadows[MAX_PROJECTILES];
+
+// the projectile the homerun label follows
+int shownProjectile = 0;
+
+// the aim preview arc
+LineBatch* previewLine;
+
+// the sling bands
+LineBatch* slingBandLines;
+
+// simulation state handed from the haptics to the graphics thread
+SnapshotBuffer snapshots;
+
+// the pose of the last published tick (haptics thread)
+SimPose lastPose;
+
+// has a snapshot been taken yet (graphics thread)
+bool snapshotTaken = false;
+
+void setLevel(int);
+void setHomerun(bool);
+void pushSceneCommand(SceneCommandType, int);
+void processSceneCommands(void);
+void showLevel(const SimSnapshot*);
+void showHomerun(bool);
+void publishSnapshot(void);
+void applySnapshot(const SimSnapshot*);
+
+//===========================================================================
+/*
+ DEMO:    GEM_membrane.cpp
+
+ This application illustrates the use of the GEM libraries to simulate
+ deformable object. In this example we load a simple mesh object and
+ build a dynamic skeleton composed of volumetric spheres and 3 dimensional
+ springs which model torsion, flexion and elongation properties.
+ */
+//===========================================================================
+
+int main(int argc, char* argv[]) {
+	//-----------------------------------------------------------------------
+	// INITIALIZATION
+	//-----------------------------------------------------------------------
+
+	// parse first arg to try and locate resources
+	resourceRoot = string(argv[0]).substr(0,
+			string(argv[0]).find_last_of("/\\") + 1);
+
+	// parse options
+	const char* scriptFile = NULL;
+	const char* recordFile = NULL;
+	const char* replayFile = NULL;
+	const char* sessionName = NULL;
+	const char* levelsName = NULL;
+	const char* soundName = NULL;
+	bool mute = false;
+	bool solve = false;
+	int generateCount = 0;
+	const char* generateFile = NULL;
+	const char* solveTable = NULL;
+	int threads = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--headless") == 0) {
+			headless = true;
+		} else if (strcmp(argv[i], "--script") == 0 && i + 1 < argc) {
+			scriptFile = argv[++i];
+		} else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			recordFile = argv[++i];
+		} else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+			replayFile = argv[++i];
+		} else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+			return runBenchmark(argv[i + 1]);
+		} else if (strcmp(argv[i], "--levels") == 0 && i + 1 < argc) {
+			levelsName = argv[++i];
+		} else if (strcmp(argv[i], "--session") == 0 && i + 1 < argc) {
+			sessionName = argv[++i];
+		} else if (strcmp(argv[i], "--sound-out") == 0 && i + 1 < argc) {
+			soundName = argv[++i];
+		} else if (strcmp(argv[i], "--mute") == 0) {
+			mute = true;
+		} else if (strcmp(argv[i], "--solve") == 0) {
+			solve = true;
+		} else if (strcmp(argv[i], "--solve-table") == 0 && i + 1 < argc) {
+			solve = true;
+			solveTable = argv[++i];
+		} else if (strcmp(argv[i], "--generate") == 0 && i + 2 < argc) {
+			generateCount = atoi(argv[++i]);
+			generateFile = argv[++i];
+		} else if (strcmp(argv[i], "--endless") == 0) {
+			endless = true;
+		} else if (strcmp(argv[i], "--difficulty") == 0 && i + 1 < argc) {
+			i++;
+			for (int d = 0; d < DIFFICULTY_COUNT; d++) {
+				if (strcmp(argv[i], DIFFICULTY_NAMES[d]) == 0) {
+					generateDifficulty = (Difficulty) d;
+				}
+			}
+		} else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+			generateSeed = strtoull(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--substeps") == 0 && i + 1 < argc) {
+			physicsSubSteps = atoi(argv[++i]);
+			if (physicsSubSteps < 1) {
+				physicsSubSteps = 1;
+			}
+		}
+	}
+	physicsTimeStep = PHYSICS_TICK / physicsSubSteps;
+
+	// desired workspace radius of the cursor
+	cursorWorkspaceRadius = 1.5;
+
+	// set the center point of the haptic device in the virtual environment
+	deviceCenter = cVector3d(-cursorWorkspaceRadius * 0.9, 0, 0);
+
+	// read the levels; a build reads and watches levels.txt in the source
+	// tree, so that saving it there reloads the game, and falls back on the
+	// copy next to the executable when it has been moved
+	levelPack = new LevelPack();
+	levelPackFile = resourceRoot + "levels.txt";
+#if defined(LEVEL_PACK_SOURCE)
+	FILE* source = fopen(LEVEL_PACK_SOURCE, "r");
+	if (source != NULL) {
+		fclose(source);
+		levelPackFile = LEVEL_PACK_SOURCE;
+	}
+#endif
+	if (levelsName != NULL) {
+		levelPackFile = levelsName;
+	}
+	if (!levelPack->load(levelPackFile.c_str())) {
+		if (levelsName != NULL) {
+			printf("could not read level pack %s\n", levelsName);
+			return (1);
+		}
+		levelPack->parse(DEFAULT_LEVEL_PACK, strlen(DEFAULT_LEVEL_PACK),
+				"built-in levels");
+		levelPackFile.clear();
+	}
+
+	// check the levels instead of playing them
+	if (solve) {
+		return solveLevels(threads, solveTable);
+	}
+	if (generateFile != NULL) {
+		return generateLevels(generateCount, generateFile,
+				generateDifficulty, generateSeed, threads);
+	}
+
+	// the levels of endless play depend on when the generator thread is
+	// done, a trace of it would not replay
+	if (endless && (recordFile != NULL || replayFile != NULL)) {
+		printf("endless play cannot be recorded or replayed\n");
+		return (1);
+	}
+
+	// play generated levels, with the next pack ready when they are done;
+	// the haptics and graphics threads keep two cores to themselves
+	if (endless) {
+		generatorThreads = threads > 0 ? threads
+				: (int) std::thread::hardware_concurrency() - 2;
+		if (generatorThreads < 1) {
+			generatorThreads = 1;
+		}
+		LevelPack* pack = generateLevelPack(generateDifficulty,
+				generateSeed++, generatorThreads);
+		if (pack != NULL) {
+			delete levelPack;
+			levelPack = pack;
+			levelPackFile.clear();
+			generatedPack = generateLevelPack(generateDifficulty,
+					generateSeed++, generatorThreads);
+		} else {
+			printf("could not generate %s levels\n",
+					DIFFICULTY_NAMES[generateDifficulty]);
+			endless = false;
+		}
+	}
+
+	//-----------------------------------------------------------------------
+	// 3D - SCENEGRAPH
+	//-----------------------------------------------------------------------
+
+	// create a new world.
+	world = new cWorld();
+
+	// set the background color of the environment
+	// the color is defined by its (R,G,B) components.
+	world->setBackgroundColor(0.0, 0.0, 0.0);
+
+	// create a camera and insert it into the virtual world
+	camera = new cCamera(world);
+	world->addChild(camera);
+
+	// position and orient the camera
+	camera->set(cVector3d(CAMERA_X, 0.0, 0.0), // camera position (eye)
+			cVector3d(0.0, 0.0, 0.0), // look-at position (target)
+			cVector3d(0.0, 0.0, 1.0)); // direction of the "up" vector
+
+	// set the near and far clipping planes of the camera
+	// anything in front/behind these clipping planes will not be rendered
+	camera->setClippingPlanes(0.01, 100.0);
+
+	// enable higher rendering quality because we are displaying transparent objects
+	camera->enableMultipassTransparency(true);
+
+	// create a light source and attach it to the camera
+	light = new cLight(world);
+	camera->addChild(light); // attach light to camera
+	light->setEnabled(true); // enable light source
+	light->setPos(cVector3d(2.0, 0.5, 1.0)); // position the light source
+	light->setDir(cVector3d(-2.0, 0.5, 1.0)); // define the direction of the light beam
 
 	//-----------------------------------------------------------------------
 	// HAPTIC DEVICES / TOOLS
 	//-----------------------------------------------------------------------
 
-	// create a haptic device handler
-	handler = new cHapticDeviceHandler();
+	if (replayFile != NULL) {
+		// play back a recorded session
+		replayDevice = new TraceReplayDevice();
+		if (!replayDevice->load(replayFile)) {
+			printf("could not read trace %s\n", replayFile);
+			return (1);
+		}
+
+		// anything else would replay a different game
+		if (replayDevice->getSubSteps() != physicsSubSteps) {
+			printf("trace %s was recorded with --substeps %i\n", replayFile,
+					replayDevice->getSubSteps());
+			return (1);
+		}
+		if (replayDevice->getPackHash() != levelPack->getHash()) {
+			printf("trace %s was recorded with other levels\n", replayFile);
+			return (1);
+		}
+		hapticDevice = replayDevice;
+		traceFile = replayFile;
+	} else if (headless) {
+		// play back a script instead of reading a real device
+		scriptedDevice = new ScriptedHapticDevice();
+		if (scriptFile == NULL) {
+			scriptedDevice->parseScript(DEFAULT_DEVICE_SCRIPT);
+		} else if (!scriptedDevice->loadScript(scriptFile)) {
+			printf("could not read device script %s\n", scriptFile);
+			return (1);
+		}
+		hapticDevice = scriptedDevice;
+	} else {
+		// create a haptic device handler
+		handler = new cHapticDeviceHandler();
 
-	// get access to the first available haptic device
-	handler->getDevice(hapticDevice, 0);
+		// get access to the first available haptic device
+		handler->getDevice(hapticDevice, 0);
+	}
 
 	// retrieve information about the current haptic device
 	cHapticDeviceInfo info;
@@ -469,8 +5177,22 @@ int main(int argc, char* argv[]) {
 		info = hapticDevice->getSpecifications();
 	}
 
-	// desired workspace radius of the cursor
-	cursorWorkspaceRadius = 1.5;
+	deviceMaxForce = info.m_maxForce;
+
+	// write the game events of this session
+	startTelemetry(sessionName);
+
+	// the sound of the sling, the bell and the ground
+	if (!mute) {
+		startSound(soundName);
+	}
+
+	// record the device input of this session
+	if (recordFile != NULL) {
+		traceRecorder = new TraceRecorder(info, physicsSubSteps,
+				levelPack->getHash());
+		traceFile = recordFile;
+	}
 
 	// read the scale factor between the physical workspace of the haptic
 	// device and the virtual workspace defined for the tool
@@ -480,9 +5202,6 @@ int main(int argc, char* argv[]) {
 	// forces actually sent to the haptic device
 	deviceForceScale = 0.1 * info.m_maxForce;
 
-	// set the center point of the haptic device in the virtual environment
-	deviceCenter = cVector3d(-cursorWorkspaceRadius * 0.9, 0, 0);
-
 	// create a large sphere that represents the haptic device
 	deviceRadius = 0.05;
 	device = new cShapeSphere(deviceRadius);
@@ -504,9 +5223,6 @@ int main(int argc, char* argv[]) {
 	cVector3d poleEnd = poleTopPos - cVector3d(0, 0, 1);
 	cShapeLine* pole = new cShapeLine(poleEnd, poleTopPos);
 	world->addChild(pole);
-	// A sling spring line
-	slingSpringLine = new cShapeLine(poleTopPos, cVector3d());
-	world->addChild(slingSpringLine);
 
 	// A top of a different pole
 	cShapeSphere* poleTop2 = new cShapeSphere(0.03);
@@ -516,29 +5232,39 @@ int main(int argc, char* argv[]) {
 	cVector3d poleEnd2 = poleTopPos2 - cVector3d(0, 0, 1);
 	cShapeLine* pole2 = new cShapeLine(poleEnd2, poleTopPos2);
 	world->addChild(pole2);
-	// A sling spring line
-	slingSpringLine2 = new cShapeLine(poleTopPos2, cVector3d());
-	world->addChild(slingSpringLine2);
+
+	// Both sling bands
+	slingBandLines = new LineBatch();
+	world->addChild(slingBandLines);
 
 	slingCenter = new cShapeSphere(0.03);
 	world->addChild(slingCenter);
 
+	// the arc of the throw being aimed
+	previewLine = new LineBatch();
+	world->addChild(previewLine);
+
 	//////////////////////////////////////////////////////////////////////////
 	// Create and add the projectile
 	//////////////////////////////////////////////////////////////////////////
-	projectile = new cShapeSphere(projectileRadius);
-	world->addChild(projectile);
-	projectile->m_material.m_ambient.set(0.4, 0.7, 0, 0.7);
-	projectile->m_material.m_diffuse.set(0.5, 0.65, 0, 0.7);
-	projectile->m_material.m_specular.set(1.0, 1.0, 1.0, 0.7);
-	projectile->m_material.setShininess(50);
-
-	// Shadow!
-	projectileShadowCircle = new CircleMesh(world, cVector3d(0.0, 0.0, groundZ
-			+ 0.0001), 0.2);
-	projectileShadowCircle->rotate(cVector3d(0, 1, 0),
-			-3.141592653589793238462643383 / 2.0);
-	projectileShadowCircle->setColor(20, 200, 0);
+	for (int i = 0; i < MAX_PROJECTILES; i++) {
+		cShapeSphere* projectile = new cShapeSphere(projectileRadius);
+		world->addChild(projectile);
+		projectile->m_material.m_ambient.set(0.4, 0.7, 0, 0.7);
+		projectile->m_material.m_diffuse.set(0.5, 0.65, 0, 0.7);
+		projectile->m_material.m_specular.set(1.0, 1.0, 1.0, 0.7);
+		projectile->m_material.setShininess(50);
+		projectile->setShowEnabled(false);
+		projectileSpheres[i] = projectile;
+
+		// Shadow!
+		projectileShadows[i] = new CircleMesh(world, cVector3d(0.0, 0.0,
+				groundZ + 0.0001), 0.2);
+		projectileShadows[i]->rotate(cVector3d(0, 1, 0),
+				-3.141592653589793238462643383 / 2.0);
+		projectileShadows[i]->setColor(20, 200, 0);
+		projectileShadows[i]->setShowEnabled(false);
+	}
 
 	//////////////////////////////////////////////////////////////////////////
 	// Create a Ground
@@ -571,30 +5297,18 @@ int main(int argc, char* argv[]) {
 	// Create a floor grid matrix (good ol' fashioned)
 	//////////////////////////////////////////////////////////////////////////
 
-	float cAlpha = 0.5;
-	for (int i = 0; i < gridLineNumber; i++) {
-		float y = i * gridLineSpacing - gridLineSpacing * gridLineNumber / 2.0;
-		float z = groundZ + 0.00001;
-		float x = gridLineSpacing * gridLineNumber / 2.0;
-
-		cShapeLine* line1 = new cShapeLine(cVector3d(-x, y, z), cVector3d(x, y,
-				z));
-
-		line1->m_ColorPointA.set(133, 0, 137, cAlpha);
-		line1->m_ColorPointB.set(0, 165, 165, cAlpha);
-		world->addChild(line1);
-
-		for (int j = 0; j < gridLineNumber; j++) {
-			float y = j * gridLineSpacing - gridLineSpacing * gridLineNumber
-					/ 2.0;
+	floorGrid = createFloorGrid();
+	world->addChild(floorGrid);
 
-			cShapeLine* line2 = new cShapeLine(cVector3d(y, -x, z), cVector3d(
-					y, x, z));
-			line2->m_ColorPointA.set(133, 0, 137, cAlpha);
-			line2->m_ColorPointB.set(0, 165, 165, cAlpha);
+	//-----------------------------------------------------------------------
+	// HEADLESS SIMULATION
+	//-----------------------------------------------------------------------
 
-			world->addChild(line2);
-		}
+	if (headless) {
+		setLevel(-1);
+		runHeadless();
+		close();
+		return (0);
 	}
 
 	//-----------------------------------------------------------------------
@@ -629,6 +5343,15 @@ int main(int argc, char* argv[]) {
 	glutAddMenuEntry("hide skeleton", OPTION_HIDESKELETON);
 	glutAttachMenu(GLUT_RIGHT_BUTTON);
 
+	// create a label as title for the homeruns
+	titleLabel = new cLabel();
+	cFont* font = cFont::createFont();
+	font->setPointSize(200);
+	font->setFontFace("Monospace");
+	font = cFont::createFont(font);
+	titleLabel->setPos(0, 0, 0);
+	titleLabel->m_font = font;
+
 	//-----------------------------------------------------------------------
 	// START SIMULATION
 	//-----------------------------------------------------------------------
@@ -643,6 +5366,19 @@ int main(int argc, char* argv[]) {
 	cThread* hapticsThread = new cThread();
 	hapticsThread->set(updateHaptics, CHAI_THREAD_PRIORITY_HAPTICS);
 
+	// reload the levels when they are edited, unless a trace is recorded or
+	// replayed since traces do not contain the levels
+	if (!levelPackFile.empty() && traceFile == NULL) {
+		cThread* watcherThread = new cThread();
+		watcherThread->set(watchLevelPack, CHAI_THREAD_PRIORITY_GRAPHICS);
+	}
+
+	// make new levels while the generated ones are played
+	if (endless) {
+		cThread* generatorThread = new cThread();
+		generatorThread->set(generateEndless, CHAI_THREAD_PRIORITY_GRAPHICS);
+	}
+
 	// start the main graphics rendering loop
 	glutMainLoop();
 
@@ -655,8 +5391,40 @@ int main(int argc, char* argv[]) {
 
 //---------------------------------------------------------------------------
 
+cGenericObject* createFloorGrid(void) {
+	LineBatch* grid = new LineBatch();
+
+	float cAlpha = 0.5;
+	cColorf colorA(133, 0, 137, cAlpha);
+	cColorf colorB(0, 165, 165, cAlpha);
+	float z = groundZ + 0.00001;
+	float x = gridLineSpacing * gridLineNumber / 2.0;
+	for (int i = 0; i < gridLineNumber; i++) {
+		float y = i * gridLineSpacing - gridLineSpacing * gridLineNumber / 2.0;
+
+		// one line along each axis
+		grid->addLine(cVector3d(-x, y, z), cVector3d(x, y, z), colorA, colorB);
+		grid->addLine(cVector3d(y, -x, z), cVector3d(y, x, z), colorA, colorB);
+	}
+
+	return grid;
+}
+
+//---------------------------------------------------------------------------
+
 void setNextLevel() {
-	if (level == levels) {
+	// in endless play the levels go on with a new generated pack, once the
+	// file watcher or generator has freed the last replaced one
+	if (endless && level + 1 >= levelPack->getLevelCount()
+			&& generatedPack.load(std::memory_order_relaxed) != NULL
+			&& retiredPack.load(std::memory_order_acquire) == NULL) {
+		retiredPack.store(levelPack, std::memory_order_release);
+		levelPack = generatedPack.exchange(NULL, std::memory_order_acquire);
+		setLevel(0);
+		return;
+	}
+
+	if (level == levelPack->getLevelCount()) {
 		// Do something when the game has ended
 	} else {
 		setLevel(level + 1);
@@ -668,34 +5436,142 @@ void setNextLevel() {
 void setLevel(int lvl) {
 	setHomerun(false);
 
-	// Remove any existing targets
-	if (lvl != -1) {
-		for (int i = 0; i < TARGETS; i++) {
-			currentTargets[i]->remove();
-		}
-	}
-
 	level = lvl;
-	if (level >= levels || level < 0) {
+	if (level >= levelPack->getLevelCount() || level < 0) {
 		level = 0;
 	}
 
 	// Initialize everything
-	for (int i = 0; i < TARGETS; i++) {
-		currentTargets[i] = new Target(world, cVector3d(
-				targetPositions[level][i * 3],
-				targetPositions[level][i * 3 + 1], targetPositions[level][i * 3
-						+ 2]), TARGET_RADIUS);
-		if (targetPositions[level][i * 3 + 2] == groundZ) {
-			currentTargets[i]->rotate();
-		}
-	}
-	projectileVel.zero();
-	projectile->setPos(cVector3d(0, 0, groundZ));
+	const LevelDef& def = levelPack->getLevel(level);
+	targetPool.reset(&levelPack->getTarget(def.firstTarget), def);
+	projectilePool.clear();
 
 	// Reset timer and counter
 	levelTimer = 0;
 	thrownBalls = 0;
+
+	// the graphics thread builds the new target meshes
+	levelSerial++;
+}
+
+//---------------------------------------------------------------------------
+
+/**
+ * Queues a scene graph change for the graphics thread. Never blocks; if the
+ * queue is full the command is dropped.
+ */
+void pushSceneCommand(SceneCommandType type, int value) {
+	SceneCommand command;
+	command.type = type;
+	command.value = value;
+	sceneCommands.push(command);
+}
+
+//---------------------------------------------------------------------------
+
+void processSceneCommands(void) {
+	SceneCommand command;
+	while (sceneCommands.pop(command)) {
+		switch (command.type) {
+		case SCENE_SHOW_HOMERUN:
+			showHomerun(command.value != 0);
+			break;
+		}
+	}
+}
+
+//---------------------------------------------------------------------------
+
+void showLevel(const SimSnapshot* snapshot) {
+	// reuse the meshes of the last level, only create missing ones
+	for (int i = 0; i < snapshot->targetCount; i++) {
+		if (i < createdVisuals) {
+			targetVisuals[i]->place(snapshot->pose.targetPos[i],
+					snapshot->targetRadius[i]);
+		} else {
+			targetVisuals[i] = new TargetVisual(world,
+					snapshot->pose.targetPos[i], snapshot->targetRadius[i]);
+			createdVisuals++;
+		}
+	}
+
+	// hide the ones this level does not need
+	for (int i = snapshot->targetCount; i < shownTargets; i++) {
+		targetVisuals[i]->hide();
+	}
+	shownTargets = snapshot->targetCount;
+	shownLevel = snapshot->level;
+	shownSerial = snapshot->levelSerial;
+}
+
+//---------------------------------------------------------------------------
+
+void watchLevelPack(void) {
+#if defined(_LINUX)
+	// watch the directory, editors often save by replacing the file
+	size_t slash = levelPackFile.find_last_of('/');
+	string directory = slash == string::npos ? "." : levelPackFile.substr(0,
+			slash + 1);
+	string name = levelPackFile.substr(slash == string::npos ? 0 : slash + 1);
+	int notify = inotify_init();
+	if (notify < 0 || inotify_add_watch(notify, directory.c_str(),
+			IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		printf("cannot watch %s for changes\n", levelPackFile.c_str());
+		return;
+	}
+
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	while (simulationRunning) {
+		// free the pack the haptics thread has stopped using
+		delete retiredPack.exchange(NULL, std::memory_order_acquire);
+
+		struct pollfd fd;
+		fd.fd = notify;
+		fd.events = POLLIN;
+		if (poll(&fd, 1, 100) <= 0) {
+			continue;
+		}
+		ssize_t n = read(notify, buffer, sizeof(buffer));
+		bool changed = false;
+		for (char* p = buffer; p < buffer + n;) {
+			struct inotify_event* event = (struct inotify_event*) p;
+			if (event->len > 0 && name == event->name) {
+				changed = true;
+			}
+			p += sizeof(struct inotify_event) + event->len;
+		}
+		if (!changed) {
+			continue;
+		}
+
+		LevelPack* pack = new LevelPack();
+		if (pack->load(levelPackFile.c_str())) {
+			printf("reloaded %s: %i levels\n", levelPackFile.c_str(),
+					pack->getLevelCount());
+			// replaces a pack the haptics thread has not taken yet
+			delete pendingPack.exchange(pack, std::memory_order_acq_rel);
+		} else {
+			delete pack;
+		}
+	}
+	::close(notify);
+#endif
+}
+
+//---------------------------------------------------------------------------
+
+void generateEndless(void) {
+	while (simulationRunning) {
+		// free the pack the haptics thread has stopped using
+		delete retiredPack.exchange(NULL, std::memory_order_acquire);
+
+		if (generatedPack.load(std::memory_order_acquire) == NULL) {
+			generatedPack.store(generateLevelPack(generateDifficulty,
+					generateSeed++, generatorThreads),
+					std::memory_order_release);
+		}
+		cSleepMs(100);
+	}
 }
 
 //---------------------------------------------------------------------------
@@ -725,32 +5601,36 @@ void keySelect(unsigned char key, int x, int y) {
 		std::cout << "vibrate: " << vibrate << std::endl;
 	} else if (key == 'h') {
 		// HOMERUUUN
-		setHomerun(!homerun);
+		showHomerun(!homerun);
 	} else if (key == 'n') {
-		setNextLevel();
+		nextLevelRequested = true;
 	} else if (key == 'f') {
 		sendForce = !sendForce;
 		std::cout << "sendforce: " << sendForce << std::endl;
+	} else if (key == 't') {
+		printTimingReport();
+	} else if (key == 'p') {
+		predictHand = !predictHand;
+		std::cout << "predict hand: " << predictHand << std::endl;
+	} else if (key == 'i') {
+		interpolateTicks = !interpolateTicks;
+		std::cout << "interpolate ticks: " << interpolateTicks << std::endl;
 	}
 }
 
 void setHomerun(bool home) {
-	homerun = home;
-	if (homerun) {
-		// create a small label as title
-		titleLabel = new cLabel();
+	pushSceneCommand(SCENE_SHOW_HOMERUN, home ? 1 : 0);
+}
 
-		cFont* font = cFont::createFont();
-		font->setPointSize(200);
-		font->setFontFace("Monospace");
-		font = cFont::createFont(font);
+//---------------------------------------------------------------------------
 
-		// define its position, color and string message, and font
-		titleLabel->setPos(0, 0, 0);
-		titleLabel->m_fontColor.set((double) random() / RAND_MAX,
-				(double) random() / RAND_MAX, (double) random() / RAND_MAX);
-		titleLabel->m_string = homerunTexts[level];
-		titleLabel->m_font = font;
+void showHomerun(bool home) {
+	homerun = home;
+	if (homerun) {
+		// define its color and string message
+		titleLabel->m_fontColor.set(threadRandom.uniform(),
+				threadRandom.uniform(), threadRandom.uniform());
+		titleLabel->m_string = homerunTexts[shownLevel % HOMERUN_TEXTS];
 
 		world->addChild(titleLabel);
 	} else {
@@ -788,25 +5668,212 @@ void close(void) {
 
 	// close haptic device
 	hapticDevice->close();
+
+	stopTelemetry();
+	stopSound();
+	printTimingReport();
+}
+
+//---------------------------------------------------------------------------
+
+void startTelemetry(const char* fileName) {
+	if (fileName != NULL) {
+		sessionFile = fopen(fileName, "w");
+		if (sessionFile == NULL) {
+			printf("could not write session %s\n", fileName);
+		} else {
+			fprintf(sessionFile, "event,level,throw,target,time,x,y,z,value\n");
+		}
+	}
+
+	telemetryRunning = true;
+	telemetryFinished = false;
+	cThread* telemetryThread = new cThread();
+	telemetryThread->set(writeTelemetry, CHAI_THREAD_PRIORITY_GRAPHICS);
+}
+
+//---------------------------------------------------------------------------
+
+void writeTelemetry(void) {
+	TelemetryEvent event;
+	bool running = true;
+	while (running) {
+		// read the flag first so that nothing queued before it is missed
+		running = telemetryRunning;
+		while (telemetryEvents.pop(event)) {
+			if (sessionFile != NULL) {
+				fprintf(sessionFile, "%s,%i,%i,%i,%f,%f,%f,%f,%f\n",
+						TELEMETRY_EVENT_NAMES[event.type], event.level,
+						event.throwCount, event.target, event.time,
+						event.pos.x, event.pos.y, event.pos.z, event.value);
+			} else if (event.type == EVENT_LEVEL_COMPLETE) {
+				// Data collecting
+				printf("%i\t%f\t%i\n", event.level, event.value,
+						event.throwCount);
+			}
+		}
+		if (running) {
+			cSleepMs(10);
+		}
+	}
+	if (sessionFile != NULL) {
+		fclose(sessionFile);
+		sessionFile = NULL;
+	}
+	fflush(stdout);
+	telemetryFinished = true;
+}
+
+//---------------------------------------------------------------------------
+
+void stopTelemetry(void) {
+	if (telemetryFinished) {
+		return;
+	}
+	telemetryRunning = false;
+	while (!telemetryFinished) {
+		cSleepMs(1);
+	}
+	if (droppedEvents > 0) {
+		printf("telemetry: %u events dropped\n", droppedEvents.load());
+	}
+}
+
+//---------------------------------------------------------------------------
+
+void startSound(const char* fileName) {
+	if (headless) {
+		// mixed by the headless loop, one tick at a time
+		if (fileName == NULL) {
+			return;
+		}
+		soundEngine = new SoundEngine();
+		soundEngine->load(resourceRoot);
+		if (!soundEngine->openWav(fileName)) {
+			printf("could not write sound %s\n", fileName);
+			return;
+		}
+		soundRunning = true;
+		return;
+	}
+
+#if defined(_ALSA)
+	soundEngine = new SoundEngine();
+	soundEngine->load(resourceRoot);
+	soundRunning = true;
+	soundFinished = false;
+	cThread* soundThread = new cThread();
+	soundThread->set(runSound, CHAI_THREAD_PRIORITY_HAPTICS);
+#endif
+}
+
+//---------------------------------------------------------------------------
+
+void runSound(void) {
+#if defined(_ALSA)
+	// a short buffer, so that a sound starts soon after its event; the
+	// thread is paced by snd_pcm_writei() waiting for room in it
+	snd_pcm_t* pcm = NULL;
+	int error = snd_pcm_open(&pcm, "default", SND_PCM_STREAM_PLAYBACK, 0);
+	if (error >= 0) {
+		error = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16_LE,
+				SND_PCM_ACCESS_RW_INTERLEAVED, 1, SOUND_RATE, 1,
+				SOUND_BUFFER_US);
+	}
+	if (error < 0) {
+		printf("sound: %s\n", snd_strerror(error));
+		soundRunning = false;
+	}
+
+	short block[SOUND_BLOCK];
+	while (soundRunning) {
+		// frames that will be played before this block
+		snd_pcm_sframes_t delay = 0;
+		if (snd_pcm_delay(pcm, &delay) < 0) {
+			delay = 0;
+		}
+		soundEngine->mix(block, SOUND_BLOCK, delay * 1000000000LL
+				/ SOUND_RATE);
+		snd_pcm_sframes_t written = snd_pcm_writei(pcm, block, SOUND_BLOCK);
+		if (written < 0) {
+			snd_pcm_recover(pcm, (int) written, 1);
+		}
+	}
+	if (pcm != NULL) {
+		snd_pcm_drop(pcm);
+		snd_pcm_close(pcm);
+	}
+#endif
+	soundFinished = true;
+}
+
+//---------------------------------------------------------------------------
+
+void stopSound(void) {
+	if (soundEngine == NULL) {
+		return;
+	}
+	soundRunning = false;
+	while (!soundFinished) {
+		cSleepMs(1);
+	}
+	soundEngine->closeWav();
+	if (soundEngine->latency.getCount() > 0) {
+		printf("\nsound latency, event to output (us):\n");
+		soundEngine->latency.print("sound");
+	}
+}
+
+//---------------------------------------------------------------------------
+
+void printTimingReport(void) {
+	unsigned long long ticks = tickPeriods.getCount();
+	if (ticks == 0) {
+		return;
+	}
+	unsigned long long overruns = tickOverruns.load();
+	printf("haptics loop: %llu ticks, %llu overruns (period > %.1f ms, "
+		"%.3f%%)\n", ticks, overruns, OVERRUN_PERIOD / 1e6, 100.0 * overruns
+			/ ticks);
+	tickPeriods.print("tick period");
+	for (int i = 0; i < PHASE_COUNT; i++) {
+		phaseTimes[i].print(HAPTIC_PHASE_NAMES[i]);
+	}
+	printf("tick periods:\n");
+	tickPeriods.printBars();
 }
 
 //---------------------------------------------------------------------------
 
 void updateGraphics(void) {
-	if (homerun) {
-		titleLabel->setPos(projectile->getPos());
-		titleLabel->m_fontColor.set((double) random() / RAND_MAX,
-				(double) random() / RAND_MAX, (double) random() / RAND_MAX);
+	// the frame period, about how long a frame takes to reach the screen
+	long long frameStart = nowNs();
+	if (lastFrameStart != 0) {
+		double period = (frameStart - lastFrameStart) * 1e-9;
+		displayLatency += 0.1 * (cMin(period, MAX_PREDICTION_TIME)
+				- displayLatency);
+	}
+	lastFrameStart = frameStart;
+
+	// carry out scene changes requested by the haptics thread
+	processSceneCommands();
 
+	// move the scene to the latest haptic ticks, every frame since the
+	// time drawn moves on even without a new tick
+	if (snapshots.update()) {
+		snapshotTaken = true;
+	}
+	if (snapshotTaken) {
+		applySnapshot(snapshots.readSlot());
 	}
 
+	if (homerun) {
+		titleLabel->setPos(projectileSpheres[shownProjectile]->getPos());
+		titleLabel->m_fontColor.set(threadRandom.uniform(),
+				threadRandom.uniform(), threadRandom.uniform());
 
+	}
 
-	// update shadow size and position
-	projectileShadowCircle->setPos(cVector3d(projectile->getPos().x,
-			projectile->getPos().y, groundZ + 0.0001));
-	projectileShadowCircle->setRadius(projectileRadius
-			/ (projectile->getPos().z + 2));
 
 	// render world
 	camera->renderView(displayW, displayH);
@@ -814,253 +5881,559 @@ void updateGraphics(void) {
 	// Swap buffers
 	glutSwapBuffers();
 
-	// check for any OpenGL errors
-	GLenum err;
-	err = glGetError();
-	if (err != GL_NO_ERROR)
-		printf("Error:  %s\n", gluErrorString(err));
+	// check for any OpenGL errors
+	GLenum err;
+	err = glGetError();
+	if (err != GL_NO_ERROR)
+		printf("Error:  %s\n", gluErrorString(err));
+
+	// inform the GLUT window to call updateGraphics again (next frame)
+	if (simulationRunning) {
+		glutPostRedisplay();
+	}
+}
+
+//---------------------------------------------------------------------------
+
+void updateHaptics(void) {
+	// reset clock
+	simClock.reset();
+
+	// time played back from a trace, replays run at the recorded pace
+	double replayTime = 0;
+	cPrecisionClock replayClock;
+	replayClock.reset();
+	replayClock.start();
+
+	// main haptic simulation loop
+	while (simulationRunning) {
+		// stop the simulation clock
+		simClock.stop();
+
+		// read the time increment in seconds
+		double timeInterval = simClock.getCurrentTimeSeconds();
+
+		// restart the simulation clock
+		simClock.reset();
+		simClock.start();
+
+		if (replayDevice != NULL) {
+			unsigned char flags;
+			if (!replayDevice->advance(timeInterval, flags)) {
+				break;
+			}
+			limitX = (flags & TRACE_LIMIT_X) != 0;
+			nextLevelRequested = (flags & TRACE_NEXT_LEVEL) != 0;
+
+			replayTime += timeInterval;
+			while (replayClock.getCurrentTimeSeconds() < replayTime) {
+			}
+		}
+
+		hapticTick(timeInterval);
+	}
+
+	reportTrace();
+
+	// exit haptics thread
+	simulationFinished = true;
+}
+
+//---------------------------------------------------------------------------
+
+/**
+ * Runs the haptics loop on the scripted device, without waiting for the
+ * clock, until the script ends. Every tick advances the simulation by
+ * HEADLESS_TIME_STEP.
+ */
+void runHeadless(void) {
+	cPrecisionClock wallClock;
+	long ticks = 0;
+
+	double simulatedTime = 0;
+	double timeInterval;
+
+	simulationRunning = true;
+	wallClock.reset();
+	wallClock.start();
+	while (simulationRunning && nextHeadlessTick(timeInterval)) {
+		hapticTick(timeInterval);
+		if (soundEngine != NULL) {
+			soundEngine->renderWav(timeInterval);
+		}
+		simulatedTime += timeInterval;
+		ticks++;
+	}
+	wallClock.stop();
+	simulationRunning = false;
+
+	double seconds = wallClock.getCurrentTimeSeconds();
+	printf("headless: %li ticks (%.1f s simulated) in %.3f s, %.0f ticks/s\n",
+			ticks, simulatedTime, seconds, seconds > 0 ? ticks / seconds : 0.0);
+
+	reportTrace();
+	simulationFinished = true;
+}
+
+//---------------------------------------------------------------------------
+
+bool nextHeadlessTick(double& timeInterval) {
+	if (replayDevice != NULL) {
+		unsigned char flags;
+		if (!replayDevice->advance(timeInterval, flags)) {
+			return false;
+		}
+		limitX = (flags & TRACE_LIMIT_X) != 0;
+		nextLevelRequested = (flags & TRACE_NEXT_LEVEL) != 0;
+		return true;
+	}
+
+	if (!scriptedDevice->advance()) {
+		return false;
+	}
+	if (scriptedDevice->takeKey() == 'n') {
+		nextLevelRequested = true;
+	}
+	timeInterval = HEADLESS_TIME_STEP;
+	return true;
+}
+
+//---------------------------------------------------------------------------
+
+void reportTrace(void) {
+	if (traceRecorder != NULL) {
+		if (traceRecorder->isFull()) {
+			printf("trace buffer full, recording was cut short\n");
+		}
+		if (traceRecorder->save(traceFile)) {
+			printf("recorded %li ticks to %s, checksum %016llx\n",
+					traceRecorder->getTicks(), traceFile, simulationHash);
+		} else {
+			printf("could not write trace %s\n", traceFile);
+		}
+	}
+	if (replayDevice != NULL) {
+		printf("replayed %li ticks from %s, checksum %016llx\n",
+				replayDevice->getTicks(), traceFile, simulationHash);
+	}
+}
+
+//---------------------------------------------------------------------------
+
+void hapticTick(double timeInterval) {
+	// measure the real tick period, timeInterval may be simulated
+	long long tickStart = nowNs();
+	if (lastTickStart != 0) {
+		long long period = tickStart - lastTickStart;
+		tickPeriods.add(period);
+		if (period > OVERRUN_PERIOD) {
+			tickOverruns.store(tickOverruns.load(std::memory_order_relaxed)
+					+ 1, std::memory_order_relaxed);
+		}
+	}
+	lastTickStart = tickStart;
+	for (int i = 0; i < PHASE_COUNT; i++) {
+		phaseTime[i] = 0;
+	}
+
+	// Update level timer
+	levelTimer += timeInterval;
+
+	// switch to a reloaded level pack once the last replaced one is freed,
+	// playing the current level again
+	if (pendingPack.load(std::memory_order_relaxed) != NULL
+			&& retiredPack.load(std::memory_order_acquire) == NULL) {
+		retiredPack.store(levelPack, std::memory_order_release);
+		levelPack = pendingPack.exchange(NULL, std::memory_order_acquire);
+		setLevel(level);
+	}
+
+	// level skipped with the 'n' key
+	bool skipLevel = nextLevelRequested.exchange(false);
+	if (skipLevel) {
+		setNextLevel();
+	}
+
+	// init temp variable
+	cVector3d force;
+	force.zero();
+
+	cVector3d realPos;
+	cVector3d pos;
+	cVector3d virtualPos;
+	bool key;
+	hapticDevice->getPosition(realPos);
+	hapticDevice->getUserSwitch(0, key);
+	if (traceRecorder != NULL) {
+		traceRecorder->record(realPos, key, timeInterval, limitX, skipLevel);
+	}
+	long long slingStart = nowNs();
+	phaseTime[PHASE_DEVICE_READ] = slingStart - tickStart;
+	realPos.mul(workspaceScaleFactor);
+	pos.copyfrom(realPos);
+	if (limitX) {
+		pos.x = 0;
+	}
+	if (pos.z < groundZ) {
+		pos.z = groundZ;
+	}
+
+	virtualPos = cAdd(center, cSub(pos, deviceCenter));
+
+	// Get vector from projectile to slingtop
+	cVector3d spring = cNegate(virtualPos);
+	double stretch = spring.length();
+	spring.normalize();
+	handVelocity.update(pos, timeInterval);
+	handPredictor.update(virtualPos, timeInterval);
+
+	double vibrationIntensity = 0.0;
+
+	if (key && !delay) {
+		keyDown = true;
+		// Set the projectile virutal position
+		projectilePool.hold(virtualPos, projectileRadius);
+
+		slingCenterPos = virtualPos;
+
+		// show where the projectile would fly if let go now
+		aimPreview.update(handPredictor.getState().pos, targetPool,
+				physicsTimeStep);
+
+		// the bands creak louder the further they are pulled
+		stretchSoundTimer += timeInterval;
+		if (stretchSoundTimer >= SOUND_STRETCH_INTERVAL) {
+			stretchSoundTimer = 0;
+			playSound(SOUND_STRETCH, stretch);
+		}
+
+		/* Activate spring */
+
+		// Add the pull of the sling bands, at most twice what they pull
+		// with at rest so that grabbing the sling away from its center does
+		// not kick the hand
+		cVector3d bandForce = cAdd(slingBand.getForce(),
+				slingBand2.getForce());
+		double maxBandForce = 2 * slingSpringConst * stretch;
+		if (bandForce.length() > maxBandForce) {
+			bandForce.normalize();
+			bandForce.mul(maxBandForce);
+		}
+		force.add(bandForce);
+
+		// Add vibration, stronger the further the sling is pulled and
+		// only while the hand moves
+		if (vibrate) {
+			vibrationIntensity = (1 - cos(M_PI * stretch / 2)) / 2;
+			//vibrationIntensity = pow(stretch / 2, 3);
+			vibrationIntensity *= smoothstep(vibrationMinSpeed,
+					vibrationMaxSpeed, handVelocity.getSpeed());
+			force.add(getVibrationForceVector(vibrationIntensity));
+		}
+
+		// add gravity to haptic device
+		// TODO: This does not give the required effect
+		//cVector3d projectileGravity = cMul(projectileMass * 30, GRAVITY);
+		//force.add(projectileGravity);
+	} else if (keyDown) {
+		// The key has been released
+		keyDown = false;
+
+		cVector3d pullBack = slingCenterPos;
+		// let go where the preview aimed, so the throw flies the arc shown
+		cVector3d aim;
+		if (aimPreview.getAim(aim)) {
+			projectilePool.hold(aim, projectileRadius);
+		}
+		int thrown = projectilePool.release();
+		aimPreview.clear();
+		stretchSoundTimer = SOUND_STRETCH_INTERVAL;
+		playSound(SOUND_STRETCH, 0);
+		if (thrown != -1) {
+			thrownBalls++;
+			recordEvent(EVENT_THROW, -1, pullBack, stretch);
+			playSound(SOUND_RELEASE, projectilePool.getVel(thrown).length());
+
+			// the sling goes on from where it let go of the projectile
+			slingCenterPos = projectilePool.getPos(thrown);
+			slingCenterVel = projectilePool.getVel(thrown);
+		}
+
+	} else {
+		// Pull the device towards the center
+		force.add(cAdd(cMul(deviceCenterForce * stretch, spring), force));
+	}
+
+	phaseTime[PHASE_SLING] = nowNs() - slingStart;
 
-	// inform the GLUT window to call updateGraphics again (next frame)
-	if (simulationRunning) {
-		glutPostRedisplay();
+	// run as many fixed physics steps as fit in the time that has passed
+	physicsAccumulator += timeInterval;
+	if (physicsAccumulator > MAX_PHYSICS_LAG) {
+		physicsAccumulator = MAX_PHYSICS_LAG;
+	}
+	while (physicsAccumulator >= physicsTimeStep * (1 - 1e-9)) {
+		stepPhysics(physicsTimeStep);
+		physicsAccumulator -= physicsTimeStep;
 	}
-}
 
-//---------------------------------------------------------------------------
+	// scale force
+	force.mul(deviceForceScale);
+	if (limitX) {
+		// restrict movement in x-axis
+		//force.x = -realPos.x * 200;
+	}
 
-void updateHaptics(void) {
-	// reset clock
-	simClock.reset();
+	// send forces to haptic device
+	long long forceStart = nowNs();
+	if (sendForce) {
+		hapticDevice->setForce(force);
 
-	// main haptic simulation loop
-	while (simulationRunning) {
-		// stop the simulation clock
-		simClock.stop();
+		// log when the device starts clipping the force
+		double forceLength = force.length();
+		if (forceLength > deviceMaxForce && !forceSaturated) {
+			recordEvent(EVENT_FORCE_SATURATION, -1, force, forceLength);
+		}
+		forceSaturated = forceLength > deviceMaxForce;
+	} else {
+		cVector3d zero(0, 0, 0);
+		hapticDevice->setForce(zero);
+	}
+	phaseTime[PHASE_SET_FORCE] = nowNs() - forceStart;
+
+	// Check if all targets have been hit
+	if (targetPool.allHit() && !delay) {
+		// SUCCESS
+		setHomerun(true);
+		delay = true;
+		timer = 0;
+
+		int latest = projectilePool.getLatest();
+		recordEvent(EVENT_LEVEL_COMPLETE, -1, latest != -1
+				? projectilePool.getPos(latest) : cVector3d(0, 0, 0), levelTimer);
+	}
 
-		// read the time increment in seconds
-		double timeInterval = simClock.getCurrentTimeSeconds();
-		if (timeInterval > 0.001) {
-			timeInterval = 0.001;
+	// check the delay
+	if (delay) {
+		timer += timeInterval;
+		if (timer > SLEEP_TIME) {
+			delay = false;
+			setNextLevel();
 		}
+	}
 
-		// restart the simulation clock
-		simClock.reset();
-		simClock.start();
+	// fingerprint of the tick for checking replays
+	if (traceRecorder != NULL || replayDevice != NULL) {
+		hashState(&level, sizeof(level));
+		hashState(projectilePool.x, sizeof(projectilePool.x));
+		hashState(projectilePool.y, sizeof(projectilePool.y));
+		hashState(projectilePool.z, sizeof(projectilePool.z));
+		hashState(projectilePool.state, sizeof(projectilePool.state));
+	}
 
-		// Update level timer
-		levelTimer += timeInterval;
+	// hand the new state over to the graphics thread
+	publishSnapshot();
 
-		// init temp variable
-		cVector3d force;
-		force.zero();
+	for (int i = 0; i < PHASE_COUNT; i++) {
+		phaseTimes[i].add(phaseTime[i]);
+	}
+}
 
-		cVector3d realPos;
-		cVector3d pos;
-		cVector3d virtualPos;
-		hapticDevice->getPosition(realPos);
-		realPos.mul(workspaceScaleFactor);
-		pos.copyfrom(realPos);
-		if (limitX) {
-			pos.x = 0;
-		}
-		if (pos.z < groundZ) {
-			pos.z = groundZ;
-		}
-
-		// Update the camera
-		// position and orient the camera
-		camera->set(cVector3d(CAMERA_X, pos.y / 6, pos.z / 6), // camera position (eye)
-				cVector3d(0.0, 0.0, 0.0), // look-at position (target)
-				cVector3d(0.0, 0.0, 1.0)); // direction of the "up" vector
-
-		virtualPos = cAdd(center, cSub(pos, deviceCenter));
-		device->setPos(virtualPos);
-
-		// Get vector from projectile to slingtop
-		cVector3d spring = cNegate(virtualPos);
-		double stretch = spring.length();
-		double stretchStep = stretch - prevStretch;
-		if (stretchStep < 0) {
-			stretchStep = -stretchStep;
-		}
-		spring.normalize();
-
-		double vibrationIntensity = 0.0;
-
-		bool key;
-		hapticDevice->getUserSwitch(0, key);
-		if (key && !delay) {
-			keyDown = true;
-			collided = false;
-			springFired = false;
-			// Set the projectile virutal position
-			projectile->setPos(virtualPos);
-			projectileVel = cVector3d(0, 0, 0);
-
-			slingCenter->setPos(virtualPos);
-
-			/* Activate spring */
-
-			// Add spring force to allaround force
-			force.add(cAdd(cMul(slingSpringConst * stretch, spring), force));
-
-			// Add vibration
-			if (vibrate) {
-				vibrationIntensity = (1 - cos(M_PI * stretch / 2)) / 2;
-				//vibrationIntensity = pow(stretch / 2, 3);
-				if (stretchStep < vibrationStep) {
-					vibrationIntensity /= 5;
-				}
-				force.add(getVibrationForceVector(vibrationIntensity));
-			}
+//---------------------------------------------------------------------------
 
-			// add gravity to haptic device
-			// TODO: This does not give the required effect
-			//cVector3d projectileGravity = cMul(projectileMass * 30, GRAVITY);
-			//force.add(projectileGravity);
-		} else if (keyDown) {
-			// The key has been released
-			keyDown = false;
+/**
+ * Moves the simulation dt seconds forward with semi-implicit Euler: the
+ * velocities are updated first and the positions with the new velocities.
+ */
+void stepPhysics(double dt) {
+	long long stepStart = nowNs();
+
+	if (!keyDown) {
+		// Pull the sling back to its initial position
+		cVector3d slingCenterAcc = cMul(-slingReturnStiffness, slingCenterPos);
+		slingCenterAcc.sub(cMul(slingReturnDrag * slingCenterVel.length(),
+				slingCenterVel));
+		slingCenterVel.add(cMul(dt, slingCenterAcc));
+		slingCenterPos.add(cMul(dt, slingCenterVel));
+	}
 
-			springFired = true;
-			projectileVel = cVector3d(0, 0, 0);
-			springFiredStep = 100000000; // ååh förlååååt förlååååååååt!!!
+	// the bands follow the sling center
+	slingBand.step(poleTopPos, slingCenterPos, dt);
+	slingBand2.step(poleTopPos2, slingCenterPos, dt);
 
-			thrownBalls++;
+	long long projectileStart = nowNs();
+	phaseTime[PHASE_SLING] += projectileStart - stepStart;
 
-		} else {
-			// Add gravitational force/acceleration to projectile - it's flying away bro
-			cVector3d gravityStep = cMul(timeInterval, GRAVITY);
-			projectileVel.add(gravityStep);
-
-			// Pull the device to its initial position
-			cVector3d slingCenterPos = slingCenter->getPos();
-			cVector3d slingCenterAcc = cNegate(slingCenterPos);
-			slingCenterVel.add(cMul(timeInterval, slingCenterAcc));
-			double stiffness = slingCenterVel.length() * 0.8;
-			slingCenterVel.sub(cMul(stiffness, slingCenterVel));
-			slingCenterPos.add(slingCenterVel);
-			slingCenter->setPos(slingCenterPos);
-
-			// Pull the device towards the center
-			force.add(cAdd(cMul(deviceCenterForce * stretch, spring), force));
-
-			// make projectile stick to ground
-			cVector3d projPos = projectile->getPos();
-			if (projPos.z + projectileVel.z < groundZ) {
-				cVector3d dir = cNormalize(projectileVel);
-				double zDistToGround = (groundZ - projPos.z) / dir.z;
-				projectile->setPos(cAdd(projPos, cMul(zDistToGround, projectileVel)));
-                projectileVel.z = -projectileVel.z*0.8;
-projectileVel.x = projectileVel.x*0.9;
-projectileVel.y = projectileVel.y*0.9;
-			}
-		}
+	// gravity and ground bounces for all projectiles
+	projectilePool.move(dt);
 
-		if (springFired) {
-			cVector3d projectilePos = projectile->getPos();
+	long long collisionStart = nowNs();
+	phaseTime[PHASE_PROJECTILE] += collisionStart - projectileStart;
 
-			double length = cSub(projectilePos, center).length();
-			if (length < springFiredStep) {
-				springFiredStep = length;
+	// Check collision with targets along the whole step
+	projectilePool.collide(targetPool, dt);
 
-				// Get vector from projectile to slingtop
-				cVector3d acc = poleTopPos - projectile->getPos();
-				double distance = acc.length() * slingSpringConst / 2;
-				cVector3d springForce = cDiv(projectileMass, acc);
-				// apply the force to the sling force
-				springForce.mul(timeInterval);
-				projectileVel.add(springForce);
+	long long targetStart = nowNs();
+	phaseTime[PHASE_COLLISION] += targetStart - collisionStart;
 
-				// Get another vector from projectile to another slingtop
-				acc = poleTopPos2 - projectile->getPos();
-				distance = acc.length() * slingSpringConst / 2;
-				springForce = cDiv(projectileMass, acc);
-				// apply the second force to the sling force
-				springForce.mul(timeInterval);
-				projectileVel.add(springForce);
+	// move targets
+	targetPool.move(dt);
 
-				slingCenterVel.copyfrom(projectileVel);
-			} else {
-				springFired = false;
-			}
+	phaseTime[PHASE_PROJECTILE] += nowNs() - targetStart;
+}
 
-		}
+//---------------------------------------------------------------------------
 
-		// Update the slingshot graphcis
-		slingSpringLine->m_pointB = slingCenter->getPos();
-		slingSpringLine2->m_pointB = slingCenter->getPos();
+/**
+ * Copies the state the graphics need into the free snapshot slot and
+ * publishes it. Called by the haptics thread once per tick, never blocks.
+ */
+void publishSnapshot(void) {
+	SimSnapshot* snapshot = snapshots.writeSlot();
+	snapshot->level = level;
+	snapshot->levelSerial = levelSerial;
+	snapshot->hand = handPredictor.getState();
+	for (int i = 0; i < MAX_PROJECTILES; i++) {
+		snapshot->projectileLive[i] = projectilePool.isLive(i);
+	}
+	snapshot->latestProjectile = projectilePool.getLatest();
+	snapshot->previewCount = aimPreview.count;
+	for (int i = 0; i < aimPreview.count; i++) {
+		snapshot->previewPoints[i] = aimPreview.points[i];
+	}
+	snapshot->targetCount = targetPool.count;
+	for (int i = 0; i < targetPool.count; i++) {
+		snapshot->targetRadius[i] = targetPool.radius[i];
+		snapshot->targetHit[i] = targetPool.collided[i];
+	}
 
-		// update position of projectile (shadow moves in updateGraphics)
-		projectile->setPos(cAdd(projectile->getPos(), projectileVel));
+	SimPose& pose = snapshot->pose;
+	pose.time = nowNs();
+	pose.levelSerial = levelSerial;
+	for (int i = 0; i < MAX_PROJECTILES; i++) {
+		pose.projectileGeneration[i] = projectilePool.generation[i];
+		pose.projectilePos[i] = projectilePool.getPos(i);
+	}
+	pose.slingCenterPos = slingCenterPos;
+	pose.bandPointCount = slingBand.getPointCount();
+	for (int i = 0; i < pose.bandPointCount; i++) {
+		pose.bandPoints[0][i] = slingBand.getPoint(i);
+		pose.bandPoints[1][i] = slingBand2.getPoint(i);
+	}
+	pose.targetCount = targetPool.count;
+	for (int i = 0; i < targetPool.count; i++) {
+		pose.targetPos[i] = targetPool.getPos(i);
+		pose.targetRot[i] = targetPool.rot[i];
+	}
 
-		/** PRINT INFO **/
-		/*string posStr;
-		 string velStr;
-		 projectile->getPos().str(posStr);
-		 projectileVel.str(velStr);
-		 std::cout << "pos: " << posStr << " | vel: " << projectileVel.z << std::endl;*/
+	// the first snapshot has no tick before it
+	snapshot->previousPose.copy(lastPose.time != 0 ? lastPose : pose);
+	lastPose.copy(pose);
+	snapshots.publish();
+}
 
-		// scale force
-		force.mul(deviceForceScale);
-		if (limitX) {
-			// restrict movement in x-axis
-			//force.x = -realPos.x * 200;
-		}
+//---------------------------------------------------------------------------
 
-		// send forces to haptic device
-		if (sendForce) {
-			hapticDevice->setForce(force);
-		} else {
-			cVector3d zero(0, 0, 0);
-			hapticDevice->setForce(zero);
-		}
+/**
+ * Moves the scene graph to a published snapshot. Graphics thread only.
+ */
+void applySnapshot(const SimSnapshot* snapshot) {
+	const SimPose& pose = snapshot->pose;
+	const SimPose& previous = snapshot->previousPose;
+	long long now = nowNs();
+
+	// Draw the moment one tick period before now, which lies between the
+	// two ticks of the snapshot however old the newest one is. Every frame
+	// then shows the same distance behind the display time, and the motion
+	// does not stutter with the beat of the frame and tick rates.
+	double f = 1;
+	bool blend = interpolateTicks && previous.levelSerial == pose.levelSerial
+			&& pose.time > previous.time;
+	if (blend) {
+		f = cClamp(1 - (double) (now - pose.time) / (pose.time
+				- previous.time), 0.0, 1.0);
+	}
 
-		// Check collision with targets
-		bool collision = true;
-		for (int i = 0; i < TARGETS; i++) {
-			currentTargets[i]->sphereCollide(projectile);
-			collision = collision && currentTargets[i]->hasCollided();
+	// the hand as it will be when this frame is shown
+	cVector3d devicePos = snapshot->hand.pos;
+	if (predictHand) {
+		devicePos = snapshot->hand.predict((now - pose.time) * 1e-9
+				+ displayLatency);
+		if (devicePos.z < groundZ) {
+			devicePos.z = groundZ;
 		}
-		if (collision && !delay) {
-			// SUCCESS
-			setHomerun(true);
-			delay = true;
-			timer = 0;
+	}
 
-			printf("%i\t%f\t%i\n", level, levelTimer, thrownBalls);
-		}
-		if (!collided) {
-			for (int i = 0; i < 3; i++) {
-				if (currentTargets[i]->sphereCollide(projectile)) {
-                    currentTargets[i]->setVel(projectileVel);
-					projectileVel = cVector3d(-projectileVel.x*0.6	,projectileVel.y*0.6,projectileVel.z*0.6);
-					collided = true;
+	// position and orient the camera, following the device
+	cVector3d handPos = cAdd(cSub(devicePos, center), deviceCenter);
+	cVector3d cameraPos(CAMERA_X, handPos.y / 6, handPos.z / 6);
+	camera->set(cameraPos, // camera position (eye)
+			cVector3d(0.0, 0.0, 0.0), // look-at position (target)
+			cVector3d(0.0, 0.0, 1.0)); // direction of the "up" vector
 
-				}
-			}
+	device->setPos(devicePos);
+	for (int i = 0; i < MAX_PROJECTILES; i++) {
+		cVector3d pos = pose.projectilePos[i];
+		if (blend && previous.projectileGeneration[i]
+				== pose.projectileGeneration[i]) {
+			pos = cAdd(cMul(1 - f, previous.projectilePos[i]), cMul(f, pos));
 		}
+		projectileSpheres[i]->setShowEnabled(snapshot->projectileLive[i]);
+		projectileShadows[i]->setShowEnabled(snapshot->projectileLive[i]);
+		if (snapshot->projectileLive[i]) {
+			projectileSpheres[i]->setPos(pos);
+
+			// update shadow size and position
+			projectileShadows[i]->setPos(cVector3d(pos.x, pos.y, groundZ
+					+ 0.0001));
+			projectileShadows[i]->setRadius(projectileRadius / (pos.z + 2));
+		}
+	}
+	if (snapshot->latestProjectile != -1) {
+		shownProjectile = snapshot->latestProjectile;
+	}
 
-    // move targets
-    for(int i = 0; i < TARGETS; i++){
-        currentTargets[i]->updatePos();
-    }
-
-
-		// check the delay
-		if (delay) {
-			timer += timeInterval;
-			if (timer > SLEEP_TIME) {
-				delay = false;
-				setNextLevel();
+	// Update the slingshot graphcis
+	slingCenter->setPos(cAdd(cMul(1 - f, previous.slingCenterPos), cMul(f,
+			pose.slingCenterPos)));
+	slingBandLines->clear();
+	cColorf bandColor(1, 1, 1, 1);
+	for (int b = 0; b < 2; b++) {
+		cVector3d last;
+		for (int i = 0; i < pose.bandPointCount; i++) {
+			cVector3d point = cAdd(cMul(1 - f, previous.bandPoints[b][i]),
+					cMul(f, pose.bandPoints[b][i]));
+			if (i > 0) {
+				slingBandLines->addLine(last, point, bandColor, bandColor);
 			}
+			last = point;
 		}
+	}
 
-		prevStretch = stretch;
+	// the aim preview, fading out along the arc
+	previewLine->clear();
+	for (int i = 1; i < snapshot->previewCount; i++) {
+		float alphaA = 1 - (float) (i - 1) / snapshot->previewCount;
+		float alphaB = 1 - (float) i / snapshot->previewCount;
+		previewLine->addLine(snapshot->previewPoints[i - 1],
+				snapshot->previewPoints[i], cColorf(1, 1, 0.4, alphaA),
+				cColorf(1, 1, 0.4, alphaB));
 	}
 
-	// exit haptics thread
-	simulationFinished = true;
+	// build new target meshes when the level has been set up again
+	if (snapshot->levelSerial != shownSerial) {
+		showLevel(snapshot);
+	}
+	for (int i = 0; i < shownTargets; i++) {
+		if (blend) {
+			targetVisuals[i]->showState(cAdd(cMul(1 - f,
+					previous.targetPos[i]), cMul(f, pose.targetPos[i])),
+					blendRotation(previous.targetRot[i], pose.targetRot[i], f),
+					snapshot->targetHit[i]);
+		} else {
+			targetVisuals[i]->showState(pose.targetPos[i], pose.targetRot[i],
+					snapshot->targetHit[i]);
+		}
+	}
 }
 
 //---------------------------------------------------------------------------
@@ -1098,8 +6471,581 @@ cVector3d getVibrationForceVector(double intensity) {
 	else if (intensity < 0)
 		intensity = 0;
 
+	return cVector3d(threadRandom.uniform() * intensity * slingVibrationConst,
+			threadRandom.uniform() * intensity * slingVibrationConst,
+			threadRandom.uniform() * intensity * slingVibrationConst);
+}
+
+//---------------------------------------------------------------------------
+// BENCHMARKS
+//---------------------------------------------------------------------------
+
+int runBenchmark(const char* name) {
+	if (strcmp(name, "vibration") == 0) {
+		benchmarkVibration();
+	} else if (strcmp(name, "collision") == 0) {
+		benchmarkCollision();
+	} else if (strcmp(name, "trajectory") == 0) {
+		benchmarkTrajectory();
+	} else if (strcmp(name, "bands") == 0) {
+		benchmarkBands();
+	} else if (strcmp(name, "latency") == 0) {
+		benchmarkLatency();
+	} else if (strcmp(name, "grid") == 0) {
+		benchmarkGrid();
+	} else if (strcmp(name, "shadow") == 0) {
+		benchmarkShadow();
+	} else {
+		printf("unknown benchmark %s\n", name);
+		return (1);
+	}
+	return (0);
+}
+
+//---------------------------------------------------------------------------
+
+// the vibration as it was, with the global lock of random()
+cVector3d getRandomVibrationForceVector(double intensity) {
+	if (intensity > 1)
+		intensity = 1;
+	else if (intensity < 0)
+		intensity = 0;
+
 	return cVector3d(((double) random() / RAND_MAX) * intensity
 			* slingVibrationConst, ((double) random() / RAND_MAX) * intensity
 			* slingVibrationConst, ((double) random() / RAND_MAX) * intensity
 			* slingVibrationConst);
 }
+
+// results go here so that the compiler cannot drop the benchmarked calls
+volatile double benchmarkSink;
+
+// keeps another thread calling random(), like the other call sites did
+std::atomic<bool> contenderRunning(false);
+
+void randomContender(void) {
+	while (contenderRunning) {
+		random();
+	}
+}
+
+/**
+ * Calls a vibration generator once per simulated tick and prints the mean,
+ * the standard deviation and the worst of the tick times in nanoseconds.
+ */
+void timeVibration(const char* label, cVector3d(*generate)(double)) {
+	const int ticks = 200000;
+	double sum = 0;
+	double sumSq = 0;
+	double worst = 0;
+
+	for (int i = 0; i < ticks; i++) {
+		std::chrono::steady_clock::time_point start =
+				std::chrono::steady_clock::now();
+		benchmarkSink = generate((i % 100) / 100.0).x;
+		double ns = std::chrono::duration<double, std::nano>(
+				std::chrono::steady_clock::now() - start).count();
+		sum += ns;
+		sumSq += ns * ns;
+		if (ns > worst) {
+			worst = ns;
+		}
+	}
+
+	double mean = sum / ticks;
+	printf("%-32s mean %7.1f ns  stddev %8.1f ns  max %9.0f ns\n", label,
+			mean, sqrt(sumSq / ticks - mean * mean), worst);
+}
+
+void benchmarkVibration(void) {
+	timeVibration("random(), alone", getRandomVibrationForceVector);
+	timeVibration("per-thread xorshift, alone", getVibrationForceVector);
+
+	// again with another thread hammering random() at the same time
+	contenderRunning = true;
+	std::thread contender(randomContender);
+	timeVibration("random(), contended", getRandomVibrationForceVector);
+	timeVibration("per-thread xorshift, contended", getVibrationForceVector);
+	contenderRunning = false;
+	contender.join();
+}
+
+//---------------------------------------------------------------------------
+
+/**
+ * Sweeps the projectile through walls of more and more targets, one physics
+ * step at a time, and prints the time per step with and without the grid.
+ */
+void benchmarkCollision(void) {
+	const int sizes[] = { 3, 30, 100, 300, MAX_TARGETS };
+	const int steps = 100000;
+	TargetPool* pool = new TargetPool();
+	FastRandom random(1);
+
+	for (unsigned int n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+		// a shooting gallery: a wall of small targets, several layers deep
+		vector<TargetDef> defs(sizes[n]);
+		for (int i = 0; i < sizes[n]; i++) {
+			defs[i].pos = cVector3d(-6 - (i / 64) * 0.5, -3 + (i % 16) * 0.4,
+					-0.8 + ((i / 16) % 4) * 0.6);
+			defs[i].radius = 0.15;
+			defs[i].axis = cVector3d(0, 0, 1);
+			defs[i].angle = 0;
+			defs[i].vel = cVector3d(0, 0, 0);
+		}
+		LevelDef level;
+		level.firstTarget = 0;
+		level.targetCount = sizes[n];
+		level.boundsMin = cVector3d(-20, -3, groundZ);
+		level.boundsMax = cVector3d(0, 3, 2);
+
+		// the same path for both, the length of a step at throwing speed
+		vector<cVector3d> from(steps);
+		cVector3d move(-30 * PHYSICS_TICK, 0, 0);
+		for (int i = 0; i < steps; i++) {
+			from[i] = cVector3d(-random.uniform() * 12, random.uniform() * 6
+					- 3, random.uniform() * 2.5 + groundZ);
+		}
+
+		double seconds[2];
+		int hits[2] = { 0, 0 };
+		for (int grid = 0; grid < 2; grid++) {
+			pool->reset(&defs[0], level);
+			std::chrono::steady_clock::time_point start =
+					std::chrono::steady_clock::now();
+			for (int i = 0; i < steps; i++) {
+				double toi;
+				cVector3d normal;
+				cVector3d to = cAdd(from[i], move);
+				int hit = grid ? pool->sweep(from[i], to, projectileRadius, toi,
+						normal) : pool->sweepAll(from[i], to, projectileRadius,
+						toi, normal);
+				if (hit != -1) {
+					hits[grid]++;
+				}
+			}
+			seconds[grid] = std::chrono::duration<double>(
+					std::chrono::steady_clock::now() - start).count();
+		}
+		// both must find the same hits
+		printf("%4i targets: every target %8.1f ns/step  grid %6.1f ns/step"
+			"  hits %i/%i\n", sizes[n], seconds[0] / steps * 1e9, seconds[1]
+				/ steps * 1e9, hits[0], hits[1]);
+	}
+	delete pool;
+}
+
+//---------------------------------------------------------------------------
+
+// one projectile step as it was written with cVector3d
+void stepBodyVectors(cVector3d& pos, cVector3d& vel, double dt) {
+	vel.add(cMul(dt, GRAVITY));
+	if (pos.z + vel.z * dt < groundZ && vel.z < 0) {
+		cVector3d dir = cNormalize(vel);
+		double distToGround = (groundZ - pos.z) / dir.z;
+		pos.add(cMul(distToGround, dir));
+		vel.z = -vel.z * 0.8;
+		vel.x = vel.x * 0.9;
+		vel.y = vel.y * 0.9;
+	}
+	pos.add(cMul(dt, vel));
+}
+
+// the swept sphere test as it was written with cVector3d
+bool sweepSphereVectors(const cVector3d& center, double radius,
+		const cVector3d& from, const cVector3d& to, double sphereRadius,
+		double& toi) {
+	cVector3d start = cSub(from, center);
+	cVector3d move = cSub(to, from);
+	double r = radius + sphereRadius;
+	double c = start.lengthsq() - r * r;
+	if (c <= 0) {
+		toi = 0;
+		return true;
+	}
+	double a = move.lengthsq();
+	double b = 2 * start.dot(move);
+	double discriminant = b * b - 4 * a * c;
+	if (a == 0 || b >= 0 || discriminant < 0) {
+		return false;
+	}
+	toi = (-b - sqrt(discriminant)) / (2 * a);
+	return toi <= 1;
+}
+
+/**
+ * Throws a batch of bodies around for two simulated seconds with the
+ * cVector3d code, the scalar kernel and the SIMD kernel, then sweeps a
+ * sphere against a wall of targets with each. Prints the time per body
+ * (or target) and how far the results are from the cVector3d ones.
+ */
+void benchmarkTrajectory(void) {
+	const int bodies = 1024;
+	const int steps = 2000;
+	const double dt = PHYSICS_TICK;
+	FastRandom random(1);
+
+	printf("SIMD width %i\n", SIMD_WIDTH);
+
+	vector<cVector3d> startPos(bodies);
+	vector<cVector3d> startVel(bodies);
+	for (int i = 0; i < bodies; i++) {
+		startPos[i] = cVector3d(random.uniform() * 2, random.uniform() - 0.5,
+				random.uniform() - 0.5);
+		startVel[i] = cVector3d(-30 * random.uniform(), 10 * random.uniform()
+				- 5, 10 * random.uniform() - 2);
+	}
+
+	// the cVector3d code, one body at a time
+	vector<cVector3d> pos(startPos);
+	vector<cVector3d> vel(startVel);
+	std::chrono::steady_clock::time_point start =
+			std::chrono::steady_clock::now();
+	for (int s = 0; s < steps; s++) {
+		for (int i = 0; i < bodies; i++) {
+			stepBodyVectors(pos[i], vel[i], dt);
+		}
+	}
+	double vectorSeconds = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count();
+	printf("%-20s %6.2f ns/body-step\n", "cVector3d", vectorSeconds / steps
+			/ bodies * 1e9);
+
+	// the kernel, scalar and SIMD
+	// the arrays are not a power of two apart, so that their elements do
+	// not map to the same cache sets
+	const int stride = bodies + 40;
+	vector<double> arrays(6 * stride);
+	vector<unsigned char> active(bodies, 1);
+	vector<unsigned char> bounced(bodies);
+	for (int simd = 0; simd < 2; simd++) {
+		BodyArrays b = { &arrays[0], &arrays[stride], &arrays[2 * stride],
+				&arrays[3 * stride], &arrays[4 * stride], &arrays[5 * stride] };
+		for (int i = 0; i < bodies; i++) {
+			b.x[i] = startPos[i].x;
+			b.y[i] = startPos[i].y;
+			b.z[i] = startPos[i].z;
+			b.vx[i] = startVel[i].x;
+			b.vy[i] = startVel[i].y;
+			b.vz[i] = startVel[i].z;
+		}
+		start = std::chrono::steady_clock::now();
+		for (int s = 0; s < steps; s++) {
+			if (simd) {
+				stepBodies(b, bodies, &active[0], dt, &bounced[0]);
+			} else {
+				stepBodiesScalar(b, 0, bodies, &active[0], dt, &bounced[0]);
+			}
+		}
+		double seconds = std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - start).count();
+
+		double difference = 0;
+		for (int i = 0; i < bodies; i++) {
+			double d = cSub(pos[i], cVector3d(b.x[i], b.y[i], b.z[i])).length();
+			if (d > difference) {
+				difference = d;
+			}
+		}
+		printf("%-20s %6.2f ns/body-step  %.1fx  max difference %g\n",
+				simd ? "kernel, SIMD" : "kernel, scalar", seconds / steps
+						/ bodies * 1e9, vectorSeconds / seconds, difference);
+	}
+
+	// sweeping against a wall of targets
+	const int targets = MAX_TARGETS;
+	const int sweeps = 20000;
+	vector<double> cx(targets), cy(targets), cz(targets), radius(targets);
+	vector<cVector3d> centers(targets);
+	for (int i = 0; i < targets; i++) {
+		centers[i] = cVector3d(-6 - (i / 64) * 0.5, -3 + (i % 16) * 0.4, -0.8
+				+ ((i / 16) % 4) * 0.6);
+		cx[i] = centers[i].x;
+		cy[i] = centers[i].y;
+		cz[i] = centers[i].z;
+		radius[i] = 0.15;
+	}
+	vector<cVector3d> from(sweeps);
+	cVector3d move(-30 * dt, 0, 0);
+	for (int i = 0; i < sweeps; i++) {
+		from[i] = cVector3d(-random.uniform() * 12, random.uniform() * 6 - 3,
+				random.uniform() * 2.5 + groundZ);
+	}
+	vector<double> toi(targets);
+	for (int variant = 0; variant < 3; variant++) {
+		int hits = 0;
+		start = std::chrono::steady_clock::now();
+		for (int s = 0; s < sweeps; s++) {
+			if (variant == 0) {
+				cVector3d to = cAdd(from[s], move);
+				for (int i = 0; i < targets; i++) {
+					double t;
+					if (sweepSphereVectors(centers[i], radius[i], from[s], to,
+							projectileRadius, t)) {
+						hits++;
+					}
+				}
+				continue;
+			} else if (variant == 1) {
+				sweepSpheresScalar(&cx[0], &cy[0], &cz[0], &radius[0], 0,
+						targets, from[s], move, projectileRadius, &toi[0]);
+			} else {
+				sweepSpheres(&cx[0], &cy[0], &cz[0], &radius[0], targets,
+						from[s], move, projectileRadius, &toi[0]);
+			}
+			for (int i = 0; i < targets; i++) {
+				if (toi[i] <= 1) {
+					hits++;
+				}
+			}
+		}
+		double seconds = std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - start).count();
+		const char* labels[] = { "sweep, cVector3d", "sweep, scalar",
+				"sweep, SIMD" };
+		printf("%-20s %6.2f ns/target  hits %i\n", labels[variant], seconds
+				/ sweeps / targets * 1e9, hits);
+	}
+}
+
+//---------------------------------------------------------------------------
+
+/**
+ * Steps a band with its end going round in a circle, as a hand pulling the
+ * sling would, and prints the time per step.
+ */
+void benchmarkBands(void) {
+	const int steps = 20000;
+	int sizes[] = { 16, 64, 256, 1024 };
+	for (int s = 0; s < 4; s++) {
+		SlingBand band(sizes[s], poleTopPos);
+		long long start = nowNs();
+		for (int i = 0; i < steps; i++) {
+			double angle = i * PHYSICS_TICK * 2 * M_PI;
+			cVector3d end(1 + 0.3 * cos(angle), 0.3 * sin(angle), 0);
+			band.step(poleTopPos, end, PHYSICS_TICK);
+		}
+		benchmarkSink = band.getForce().x;
+		printf("%5d segments %8.2f us/step\n", sizes[s], (nowNs() - start)
+				/ 1000.0 / steps);
+	}
+}
+
+//---------------------------------------------------------------------------
+
+// display refresh assumed by the latency benchmark
+const double BENCH_FRAME_PERIOD = 1.0 / 60;
+
+/**
+ * The position of a recorded hand t seconds in, between its ticks.
+ */
+cVector3d handAt(const vector<cVector3d>& hand, double t) {
+	double tick = cClamp(t / HEADLESS_TIME_STEP, 0.0, hand.size() - 1.0);
+	int i = (int) tick;
+	if (i + 1 >= (int) hand.size()) {
+		return hand[i];
+	}
+	double f = tick - i;
+	return cAdd(cMul(1 - f, hand[i]), cMul(f, hand[i + 1]));
+}
+
+/**
+ * Plays a device script at 1 kHz like the haptics thread and draws the
+ * device 60 times a second, every frame from the newest tick and shown a
+ * frame later. Prints the delay of the hand that fits the drawn positions
+ * best, and how far they are from the hand when they are shown.
+ */
+void measureLatency(const char* label, const char* script) {
+	ScriptedHapticDevice device;
+	device.parseScript(script);
+	vector<cVector3d> hand;
+	vector<MotionState> states;
+	MotionPredictor predictor(HAND_PREDICTOR_ALPHA);
+	while (device.advance()) {
+		cVector3d pos;
+		device.getPosition(pos);
+		pos.mul(1000); // mm
+		predictor.update(pos, HEADLESS_TIME_STEP);
+		hand.push_back(pos);
+		states.push_back(predictor.getState());
+	}
+
+	// squared errors against the hand delayed by -MAX_LAG to MAX_LAG ms
+	const int MAX_LAG = 40;
+	for (int predicted = 0; predicted < 2; predicted++) {
+		double errors[2 * MAX_LAG + 1] = { 0 };
+		int frames = 0;
+		for (double frame = 0.1;; frame += BENCH_FRAME_PERIOD) {
+			double shown = frame + BENCH_FRAME_PERIOD;
+			int tick = (int) (frame / HEADLESS_TIME_STEP);
+			if (shown / HEADLESS_TIME_STEP >= hand.size() - 1) {
+				break;
+			}
+			cVector3d drawn = predicted ? states[tick].predict(shown - tick
+					* HEADLESS_TIME_STEP) : hand[tick];
+			for (int lag = -MAX_LAG; lag <= MAX_LAG; lag++) {
+				cVector3d d = cSub(drawn, handAt(hand, shown - lag * 0.001));
+				errors[lag + MAX_LAG] += d.lengthsq();
+			}
+			frames++;
+		}
+		int best = 0;
+		for (int lag = -MAX_LAG; lag <= MAX_LAG; lag++) {
+			if (errors[lag + MAX_LAG] < errors[best + MAX_LAG]) {
+				best = lag;
+			}
+		}
+		printf("%-14s %-9s  latency %3d ms  error %6.3f mm rms\n", label,
+				predicted ? "predicted" : "raw", best, sqrt(errors[MAX_LAG]
+						/ frames));
+	}
+}
+
+void benchmarkLatency(void) {
+	// aiming from side to side with the sling pulled back
+	string sweep;
+	char line[80];
+	for (int i = 0; i < 600; i++) {
+		double t = i * 0.01;
+		snprintf(line, sizeof(line), "10 %f %f %f 1\n", 0.015 - 0.005 * cos(2
+				* M_PI * 0.3 * t), 0.019 * sin(2 * M_PI * 0.5 * t), -0.004
+				+ 0.003 * sin(2 * M_PI * 0.8 * t));
+		sweep += line;
+	}
+
+	printf("motion to photon, hand positions in device mm, %.0f Hz display\n",
+			1 / BENCH_FRAME_PERIOD);
+	measureLatency("default script", DEFAULT_DEVICE_SCRIPT);
+	measureLatency("aiming sweep", sweep.c_str());
+}
+
+//---------------------------------------------------------------------------
+
+// the grid as it was, one cShapeLine per line and the second family of lines
+// made 80 times over
+cGenericObject* createLegacyFloorGrid(void) {
+	cGenericObject* grid = new cGenericObject();
+
+	float cAlpha = 0.5;
+	for (int i = 0; i < gridLineNumber; i++) {
+		float y = i * gridLineSpacing - gridLineSpacing * gridLineNumber / 2.0;
+		float z = groundZ + 0.00001;
+		float x = gridLineSpacing * gridLineNumber / 2.0;
+
+		cShapeLine* line1 = new cShapeLine(cVector3d(-x, y, z), cVector3d(x, y,
+				z));
+
+		line1->m_ColorPointA.set(133, 0, 137, cAlpha);
+		line1->m_ColorPointB.set(0, 165, 165, cAlpha);
+		grid->addChild(line1);
+
+		for (int j = 0; j < gridLineNumber; j++) {
+			float y = j * gridLineSpacing - gridLineSpacing * gridLineNumber
+					/ 2.0;
+
+			cShapeLine* line2 = new cShapeLine(cVector3d(y, -x, z), cVector3d(
+					y, x, z));
+			line2->m_ColorPointA.set(133, 0, 137, cAlpha);
+			line2->m_ColorPointB.set(0, 165, 165, cAlpha);
+
+			grid->addChild(line2);
+		}
+	}
+
+	return grid;
+}
+
+//---------------------------------------------------------------------------
+
+/**
+ * Draws each grid in a window the size of the game's, with multipass
+ * transparency like the game, and waits for every frame to finish.
+ */
+void benchmarkGrid(void) {
+	int argc = 1;
+	char name[] = "slingajinglebell";
+	char* argv[] = { name, NULL };
+	glutInit(&argc, argv);
+	glutInitWindowSize(WINDOW_SIZE_W, WINDOW_SIZE_H);
+	glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GLUT_DOUBLE);
+	glutCreateWindow(name);
+
+	world = new cWorld();
+	camera = new cCamera(world);
+	world->addChild(camera);
+	camera->set(cVector3d(CAMERA_X, 0.0, 0.0), cVector3d(0.0, 0.0, 0.0),
+			cVector3d(0.0, 0.0, 1.0));
+	camera->setClippingPlanes(0.01, 100.0);
+	camera->enableMultipassTransparency(true);
+
+	const int frames = 200;
+	const char* labels[2] = { "batched grid", "legacy grid" };
+	for (int g = 0; g < 2; g++) {
+		cGenericObject* grid = g == 0 ? createFloorGrid()
+				: createLegacyFloorGrid();
+		world->addChild(grid);
+		camera->renderView(WINDOW_SIZE_W, WINDOW_SIZE_H);
+		glFinish();
+		long long start = nowNs();
+		for (int i = 0; i < frames; i++) {
+			camera->renderView(WINDOW_SIZE_W, WINDOW_SIZE_H);
+			glFinish();
+		}
+		printf("%-13s %8.3f ms/frame\n", labels[g], (nowNs() - start) / 1e6
+				/ frames);
+		world->removeChild(grid);
+	}
+}
+
+//---------------------------------------------------------------------------
+
+/**
+ * Resident memory of the process in kB, or -1 where it cannot be read.
+ */
+long residentKb(void) {
+#if defined(_LINUX)
+	FILE* file = fopen("/proc/self/statm", "r");
+	if (file == NULL) {
+		return -1;
+	}
+	long size;
+	long resident;
+	int read = fscanf(file, "%ld %ld", &size, &resident);
+	fclose(file);
+	return read == 2 ? resident * (sysconf(_SC_PAGESIZE) / 1024) : -1;
+#else
+	return -1;
+#endif
+}
+
+/**
+ * Soak test of the projectile shadows: moves and resizes one like every
+ * frame of a flight does, millions of times, and prints the resident memory
+ * along the way. It used to grow with every call when setRadius rebuilt the
+ * mesh.
+ */
+void benchmarkShadow(void) {
+	const int calls = 5000000;
+	const int reports = 5;
+	world = new cWorld();
+	CircleMesh shadow(world, cVector3d(0, 0, groundZ), projectileRadius);
+
+	// the first printf and reading /proc page in code and buffers of their
+	// own, count from after them
+	printf("%ld kB resident at start, %d calls of setPos and setRadius\n",
+			residentKb(), calls);
+	long before = residentKb();
+	printf("%10d calls %8ld kB resident\n", 0, before);
+	long long start = nowNs();
+	for (int i = 1; i <= calls; i++) {
+		double height = (i % 1000) * 0.005;
+		shadow.setPos(cVector3d(-height, 0, groundZ + 0.0001));
+		shadow.setRadius(projectileRadius / (height + 2));
+		if (i % (calls / reports) == 0) {
+			printf("%10d calls %8ld kB resident\n", i, residentKb());
+		}
+	}
+	double seconds = (nowNs() - start) * 1e-9;
+	printf("%.1f ns per call, %+ld kB\n", seconds * 1e9 / calls, residentKb()
+			- before);
+}